@@ -3,91 +3,2119 @@
 #include <linux/pci.h>
 #include <linux/interrupt.h>
 #include <linux/io.h>
+#include <linux/iopoll.h>
+#include <linux/io-64-nonatomic-lo-hi.h>
 #include <linux/dma-mapping.h>
 #include <linux/netdevice.h>
 #include <linux/etherdevice.h>
+#include <linux/crc32.h>
+#include <linux/if_vlan.h>
+#include <net/page_pool/helpers.h>
+#include <net/devlink.h>
 
 #define DRV_NAME            "minimal_pcie_nic_drv"
 #define VENDOR_ID           0x1af4
 #define DEVICE_ID           0x10f1
-#define MAX_MSI_VECTORS     4 // define in qemu pci device minimal_pci_nic
-#define MAX_MSIX_VECTORS    4 // define in qemu pci device minimal_pci_nic
+#define VF_DEVICE_ID        0x10f2 // SR-IOV VF of DEVICE_ID, same register model
+#define MAX_VECTORS         64 // qemu "vectors" property limit for MSI-X
+#define MSIX_BAR            2 // BAR0 is 64-bit and takes two slots
 
-#define MSIX_ENABLE
+static bool hdr_split;
+module_param(hdr_split, bool, 0444);
+MODULE_PARM_DESC(hdr_split, "Split L2-L4 headers from page-aligned payload on RX");
+
+static bool event_idx = true;
+module_param(event_idx, bool, 0444);
+MODULE_PARM_DESC(event_idx, "Skip doorbells and interrupts the other side is not waiting for");
+
+static unsigned int rx_strides;
+module_param(rx_strides, uint, 0444);
+MODULE_PARM_DESC(rx_strides, "Pack RX frames into N 256-byte strides per buffer (power of 2, 0 = off)");
+
+static bool tx_llq = true;
+module_param(tx_llq, bool, 0444);
+MODULE_PARM_DESC(tx_llq, "Push TX descriptors and headers into device memory when supported");
+
+static unsigned int stats_interval_ms = 1000;
+module_param(stats_interval_ms, uint, 0444);
+MODULE_PARM_DESC(stats_interval_ms, "How often the NIC refreshes its counters in host memory (0 = never)");
+
+static bool cqe_compress = true;
+module_param(cqe_compress, bool, 0444);
+MODULE_PARM_DESC(cqe_compress, "Let the NIC pack RX completions of a burst into one block");
+
+static unsigned int rx_copybreak = 256;
+module_param(rx_copybreak, uint, 0644);
+MODULE_PARM_DESC(rx_copybreak, "Header split: copy frames up to this size and keep the page posted");
+
+/* Traffic generator settings, applied when the traffic-gen flag is set */
+static unsigned int gen_rate;
+module_param(gen_rate, uint, 0644);
+MODULE_PARM_DESC(gen_rate, "traffic-gen: frames per second (0 = as fast as RX buffers allow)");
+
+static unsigned int gen_size_min = 60;
+module_param(gen_size_min, uint, 0644);
+MODULE_PARM_DESC(gen_size_min, "traffic-gen: smallest frame, bytes without FCS");
+
+static unsigned int gen_size_max = 60;
+module_param(gen_size_max, uint, 0644);
+MODULE_PARM_DESC(gen_size_max, "traffic-gen: largest frame, sizes are spread evenly in between");
+
+static unsigned int gen_flows = 1;
+module_param(gen_flows, uint, 0644);
+MODULE_PARM_DESC(gen_flows, "traffic-gen: number of UDP flows");
 
 /* Ring Configurations */
+/* *_BASE registers hold 64-bit DMA addresses: lo at the offset, hi at +4 */
 #define REG_RX_RING_BASE   0x10
 #define REG_RX_RING_SIZE   0x18
 #define REG_RX_TAIL        0x1C
 #define REG_RX_HEAD        0x20
 
-#define RX_RING_SIZE        16
-#define RX_BUF_SIZE         2048
-#define RX_DONE             1
+/* RX filter */
+#define REG_RX_CTRL        0x24
+#define REG_UC_TABLE       0x100   // 16 x {lo, hi} perfect-match unicast MACs
+#define REG_MC_HASH        0x400   // 4096-bit multicast hash filter
+#define REG_VLAN_TABLE     0x600   // 4096-bit VLAN ID filter
+
+#define RX_CTRL_PROMISC     BIT(0)
+#define RX_CTRL_ALLMULTI    BIT(1)
+#define RX_CTRL_VLAN_FILTER BIT(2)
+#define RX_CTRL_VLAN_STRIP  BIT(3)
+#define RX_CTRL_HDR_SPLIT   BIT(4)
+#define RX_CTRL_CQE_COMPRESS BIT(5)
+
+#define UC_TABLE_ENTRIES    16
+#define UC_ENTRY_VALID      BIT(31)
+#define MAC_VALID           BIT(31)
+#define MC_HASH_WORDS       128
+#define VLAN_TABLE_WORDS    128
+
+#define REG_RX_HDR_SIZE    0x2C
+#define REG_TX_RING_BASE   0x30
+#define REG_TX_RING_SIZE   0x38
+#define REG_TX_TAIL        0x3C
+#define REG_TX_HEAD        0x40
+#define REG_IRQ_MASK_SET   0x44  // W1S: NIC stops raising vector N
+#define REG_IRQ_MASK_CLR   0x48  // W1C: NIC re-raises vector N if an event is pending
+#define REG_EVENT_BASE     0x50  // struct event_idx, 0 = notification suppression off
+#define REG_RX_CQ_BASE     0x58
+#define REG_TX_CQ_BASE     0x60
+#define REG_RX_STRIDE_SIZE 0x68
+#define REG_RX_STRIDE_NUM  0x6C
+#define REG_DEV_CAPS       0x70  // RO: DEV_CAP_* optional features
+#define REG_TX_CTRL        0x74
+
+#define REG_AQ_BASE        0x78
+#define REG_AQ_SIZE        0x80
+#define REG_AQ_TAIL        0x84  // doorbell: admin commands posted up to here
+#define REG_AQ_HEAD        0x88
+#define REG_MAC_LO         0x8C  // RO: permanent MAC, bytes 0-3
+#define REG_MAC_HI         0x90  // RO: bytes 4-5, MAC_VALID when assigned
+#define REG_LB_CTRL        0x94  // LB_CTRL_*: benchmark modes
+#define REG_GEN_RATE       0x98
+#define REG_GEN_SIZE_MIN   0x9C
+#define REG_GEN_SIZE_MAX   0xA0
+#define REG_GEN_FLOWS      0xA4
+#define REG_LB_DROPS       0xA8  // RO: looped or generated frames with no buffer
+#define REG_DRV_FEATURES   0xAC  // DEV_CAP_* this driver uses, written at probe
+
+/* Per-queue register blocks: doorbells and heads of queue q */
+#define QREG_BASE          0x800
+#define QREG_STRIDE        0x10
+#define QREG_RX_TAIL       0x0
+#define QREG_RX_HEAD       0x4
+#define QREG_TX_TAIL       0x8
+#define QREG_TX_HEAD       0xC
+#define QREG(q, reg)       (QREG_BASE + (q) * QREG_STRIDE + (reg))
+
+#define DEV_CAP_LLQ         BIT(0)
+#define DEV_CAP_RX          BIT(1)
+#define DEV_CAP_TX          BIT(2)
+#define DEV_CAP_MSI         BIT(3)
+#define DEV_CAP_MSIX        BIT(4)
+#define DEV_CAP_VLAN        BIT(5)
+#define DEV_CAP_HDR_SPLIT   BIT(6)
+#define DEV_CAP_RX_STRIDE   BIT(7)
+#define DEV_CAP_CQE_COMPRESS BIT(8)
+#define DEV_CAP_EVENT_IDX   BIT(9)
+#define TX_CTRL_LLQ         BIT(0)
+
+#define LB_CTRL_LOOPBACK    BIT(0) // TX comes back on RX, nothing leaves the NIC
+#define LB_CTRL_GEN         BIT(1) // RX is fed by the NIC's traffic generator
+
+#define PRIV_FLAG_TRAFFIC_GEN   BIT(0)
+
+#define HEALTH_INTERVAL     HZ   // stall check period
+#define HEALTH_GRACE_MS     1000 // no second auto-recovery of a queue before this
+#define RX_STARVE_CHECKS    2    // checks in a row with no RX buffer at the NIC
+
+#define RX_RING_DEFAULT     256
+#define RX_RING_MAX         4096 // ethtool -G limit
+#define RX_BUF_SIZE         2048 // minimum, grows with the MTU
+#define RX_HDR_SIZE         256  // per-descriptor header buffer in split mode
+#define RX_DONE             1
+#define RX_VLAN             2    // TCI was stripped into vlan_tci
+#define RX_SPLIT            4    // hdr_len bytes at hdr_addr, rest at addr
+#define RX_BUF_LAST         8    // striding: NIC is done with this buffer
+#define RX_STRIDE_SIZE      256
+#define RX_MAX_STRIDES      128  // keeps a striding buffer within u16 len
+#define RX_REFILL_BATCH     32   // descriptors reposted per RX tail write
+
+#define TX_RING_DEFAULT     256
+#define TX_RING_MAX         4096
+#define RING_MIN            16
+#define JUMBO_MTU           9000
+#define TX_DONE             1
+#define TX_VLAN_INSERT      2    // NIC inserts vlan_tci on the wire
+
+/*
+ * Low-latency queue: BAR2 holds one LLQ_ENTRY_SIZE slot per TX descriptor,
+ * a struct tx_desc followed by the first hdr_len bytes of the frame. The
+ * NIC reads it from its own memory on the doorbell instead of fetching it.
+ */
+#define LLQ_BAR             4
+#define LLQ_ENTRY_SIZE      256
+#define LLQ_HDR_MAX         128
+
+/* QEMU NIC reads and writes exactly this layout using PCIe DMA */
+struct rx_desc {
+    u64 addr;       // where NIC must DMA the packet (payload in split mode)
+    u16 len;        // buffer size from driver, frame length written by NIC
+    u16 flags;      // DONE bit from NIC
+    u16 vlan_tci;   // stripped tag, valid with RX_VLAN
+    u16 hdr_len;    // bytes written to hdr_addr, valid with RX_SPLIT
+    u64 hdr_addr;   // header buffer in split mode
+};
+
+struct tx_desc {
+    u64 addr;       // where NIC reads the frame from
+    u16 len;        // frame length without the VLAN tag
+    u16 flags;      // TX_VLAN_INSERT from driver, DONE bit from NIC
+    u16 vlan_tci;   // tag to insert, valid with TX_VLAN_INSERT
+    u16 hdr_len;    // LLQ: frame bytes pushed inline, addr points past them
+};
+
+/*
+ * Completion queue entry, one per submission ring slot. The NIC writes
+ * them in order and flips CQE_PHASE on every pass over the queue.
+ */
+struct cq_entry {
+    u16 id;         // submission ring slot that completed
+    u16 len;
+    u16 flags;      // RX_* / TX_* status bits and CQE_PHASE
+    u16 vlan_tci;
+    u16 hdr_len;
+    u16 stride;     // first stride used, striding RX only
+    u16 rsvd[2];
+};
+
+#define CQE_PHASE           0x8000
+#define CQE_COMPRESSED      0x4000  // title of a block, hdr_len = frame count
+#define CQE_MINI_PER_ENTRY  7       // u16 lengths packed in one cq_entry slot
+#define CQE_MINI_FLAGS      2       // word skipped: flags, with the stale phase
+
+/*
+ * Admin queue command: control-plane setup is DMA'd to the NIC in typed
+ * commands instead of one trapping register write per field. The NIC
+ * writes status and then sets AQ_DONE in the slot.
+ */
+struct aq_cmd {
+    u16 opcode;     // AQ_OPC_*
+    u16 flags;      // AQ_DONE from NIC
+    u16 status;     // AQ_STATUS_*, valid with AQ_DONE
+    u16 qtype;      // AQ_QTYPE_*, queue commands
+    u32 val;        // rx_ctrl, MTU, or AQ_FILTER_* table
+    u32 ring_size;  // create queue
+    u64 addr;       // ring base, or the payload buffer
+    u64 cq_addr;    // create queue: completion queue
+    u32 hdr_size;   // create RX queue
+    u32 stride_size;
+    u32 stride_num;
+    u32 offset;     // set filter: first table word
+    u32 len;        // payload: filter words, or stats bytes
+    u32 vector;     // create queue: completion interrupt vector
+    u32 rsvd[2];
+};
+
+#define AQ_DONE                 1
+
+#define AQ_OPC_CREATE_QUEUE     1
+#define AQ_OPC_DESTROY_QUEUE    2
+#define AQ_OPC_SET_RSS          3
+#define AQ_OPC_SET_RX_CTRL      4
+#define AQ_OPC_SET_FILTER       5
+#define AQ_OPC_QUERY_STATS      6
+#define AQ_OPC_SET_MTU          7
+#define AQ_OPC_SET_STATS        8
+#define AQ_OPC_STOP_QUEUE       9
+#define AQ_OPC_RESET_QUEUE      10
+
+#define AQ_STATUS_OK            0
+#define AQ_STATUS_UNSUPPORTED   3
+
+#define AQ_QTYPE_RX             0
+#define AQ_QTYPE_TX             1
+
+#define AQ_FILTER_UC            0
+#define AQ_FILTER_MC            1
+#define AQ_FILTER_VLAN          2
+
+#define AQ_RING_SIZE            16
+#define AQ_BUF_SIZE             512  // largest payload: the multicast hash
+#define AQ_TIMEOUT_US           10000
+
+/*
+ * Counters the NIC DMAs into host memory every stats_interval_ms, so
+ * reading them costs no MMIO. seq is odd while a snapshot is in flight.
+ */
+struct stats_page {
+    u32 seq;
+    u32 rsvd;
+    u64 rx_packets;
+    u64 rx_bytes;
+    u64 rx_filter_drops;
+    u64 rx_len_errors;
+    u64 tx_packets;
+    u64 tx_bytes;
+    u64 tx_errors;
+};
+
+/*
+ * Shared with the NIC, like virtio's EVENT_IDX: each side publishes the
+ * ring position at which it wants to be notified.
+ */
+struct event_idx {
+    u32 rx_tail;            // driver: shadow of REG_RX_TAIL
+    u32 rx_used_event;      // driver: interrupt when RX completions pass this
+    u32 rx_avail_event;     // NIC: doorbell when rx_tail passes this
+    u32 tx_tail;            // driver: shadow of REG_TX_TAIL
+    u32 tx_used_event;      // driver: interrupt when NIC head passes this
+    u32 tx_avail_event;     // NIC: doorbell when tx_tail passes this
+};
+
+/* Per-vector IRQ cookie, so /proc/interrupts names what each vector serves */
+struct minimal_vec {
+    struct minimal_dev *mdev;
+    char name[32];
+};
+
+struct minimal_dev {
+    struct pci_dev *pdev;
+    void __iomem *bar0;    // MMIO registers
+    void __iomem *msix_bar; // MSI-X table/PBA (optional mapping)
+    void __iomem *llq;     // llq_map while the TX ring fits in it, else NULL
+    void __iomem *llq_map; // BAR4 mapped write-combining, NULL without LLQ
+    resource_size_t llq_len;
+    int nvec_irq;
+    int rx_vector;         // vectors picked from what the PCI core granted;
+    int tx_vector;         // equal when only one vector is available
+    struct minimal_vec vecs[MAX_VECTORS];
+    struct net_device *netdev;
+    struct napi_struct rx_napi;
+    struct napi_struct tx_napi;
+
+    struct rx_desc *rx_ring;   // Virtual address where Linux sees the descriptor ring
+    dma_addr_t rx_ring_dma;     // Physical address QEMU NIC uses to access ring
+
+    u32 rx_ring_size;               // power of 2, changed with ethtool -G
+    u32 buf_size;                   // RX copy buffers and TX slots, sized for the MTU
+
+    void **rx_bufs;                 // Actual packet buffers linux will use to access data
+    dma_addr_t *rx_bufs_dma;        // Physical addresses of those buffers
+    struct cq_entry *rx_cq;         // NIC appends one entry per received frame
+    dma_addr_t rx_cq_dma;
+    u32 rx_cq_size;                 // rx_ring_size, times strides per buffer
+    u32 rx_next;                    // next RX completion to consume
+    u16 rx_phase;                   // CQE_PHASE value of valid entries this pass
+    u32 rx_tail;                    // NIC owns [NIC head, rx_tail)
+    u32 rx_refill;                  // consumed slots not yet reposted
+    u32 rx_refill_batch;
+
+    u32 lb_ctrl;                    // LB_CTRL_*, from features and priv flags
+    u32 caps;                       // DEV_CAP_* the device offers
+    u32 features;                   // the subset acked in REG_DRV_FEATURES
+
+    struct event_idx *event;        // NULL when event_idx is off
+    dma_addr_t event_dma;
+
+    /* Header split: small coherent header slots, page-sized payload buffers */
+    bool hdr_split;
+    void *rx_hdr_bufs;
+    dma_addr_t rx_hdr_dma;
+    struct page **rx_pages;         // NULL: page went up the stack, refill replaces it
+    dma_addr_t *rx_pages_dma;
+    struct page_pool *page_pool;    // header split payload pages
+    unsigned int rx_page_order;     // order-0 for header split, larger when striding
+
+    /* Striding RX: buffers are mapped once and recycled, frames copied out */
+    unsigned int rx_strides;
+
+    struct tx_desc *tx_ring;
+    dma_addr_t tx_ring_dma;
+    u32 tx_ring_size;
+    void **tx_bufs;
+    dma_addr_t *tx_bufs_dma;
+    u32 tx_tail;                    // next descriptor the driver fills
+    u32 tx_clean;                   // oldest descriptor not yet completed
+    struct cq_entry *tx_cq;
+    dma_addr_t tx_cq_dma;
+    u16 tx_phase;
+
+    /* Shadow copies of the device filter tables, so only changed words are written */
+    u32 mc_hash[MC_HASH_WORDS];
+    u32 vlan_table[VLAN_TABLE_WORDS];
+
+    /* Admin queue: one command in flight, waited for under aq_lock */
+    struct aq_cmd *aq;
+    dma_addr_t aq_dma;
+    u32 aq_tail;
+    void *aq_buf;                   // command payload, in or out
+    dma_addr_t aq_buf_dma;
+    spinlock_t aq_lock;             // ndo_set_rx_mode can't sleep
+
+    struct stats_page *stats;       // NULL if the NIC couldn't be set up
+    dma_addr_t stats_dma;
+
+    /* Queue recovery, run from a work item: ndo_tx_timeout can't sleep */
+    struct work_struct reset_work;
+    unsigned long reset_pending;    // BIT(AQ_QTYPE_*) waiting for reset_work
+
+    /* devlink health: stall detection, ring dumps and recovery */
+    struct devlink *devlink;        // NULL if it couldn't be registered
+    struct devlink_health_reporter *reporter[2];    // by AQ_QTYPE_*
+    struct delayed_work health_work;
+    u32 tx_last_head;               // NIC TX head at the previous check
+    u32 tx_last_tail;
+    u32 rx_last_next;               // rx_next at the previous check
+    bool rx_last_ready;             // a completion was waiting at rx_next
+    unsigned int rx_starved;        // checks in a row the NIC had no buffer
+};
+
+/*
+ * Post one admin command and spin until the NIC completes it. len bytes
+ * of payload are copied from in before, or to out after, the command.
+ */
+static int minimal_aq_exec(struct minimal_dev *mdev, struct aq_cmd *cmd,
+                           const void *in, void *out, size_t len)
+{
+    struct aq_cmd *slot;
+    u16 flags;
+    int ret;
+
+    if (len > AQ_BUF_SIZE)
+        return -EINVAL;
+
+    spin_lock_bh(&mdev->aq_lock);
+
+    if (in)
+        memcpy(mdev->aq_buf, in, len);
+    if (len)
+        cmd->addr = mdev->aq_buf_dma;
+    cmd->flags = 0;
+    cmd->status = 0;
+
+    slot = &mdev->aq[mdev->aq_tail];
+    *slot = *cmd;
+    mdev->aq_tail = (mdev->aq_tail + 1) % AQ_RING_SIZE;
+
+    /* Command must be visible before the doorbell */
+    dma_wmb();
+    writel(mdev->aq_tail, mdev->bar0 + REG_AQ_TAIL);
+
+    ret = read_poll_timeout_atomic(READ_ONCE, flags, flags & AQ_DONE,
+                                   1, AQ_TIMEOUT_US, false, slot->flags);
+    if (!ret) {
+        dma_rmb();
+        if (slot->status == AQ_STATUS_UNSUPPORTED)
+            ret = -EOPNOTSUPP;
+        else if (slot->status != AQ_STATUS_OK)
+            ret = -EIO;
+        else if (out)
+            memcpy(out, mdev->aq_buf, len);
+    }
+
+    spin_unlock_bh(&mdev->aq_lock);
+
+    if (ret)
+        dev_err(&mdev->pdev->dev, "admin opcode %u failed: %d\n",
+                cmd->opcode, ret);
+    return ret;
+}
+
+static int minimal_aq_set_filter(struct minimal_dev *mdev, u32 table,
+                                 u32 offset, const u32 *words, u32 count)
+{
+    struct aq_cmd cmd = {
+        .opcode = AQ_OPC_SET_FILTER,
+        .val = table,
+        .offset = offset,
+        .len = count,
+    };
+
+    return minimal_aq_exec(mdev, &cmd, words, NULL, count * sizeof(*words));
+}
+
+static int minimal_aq_set_rx_ctrl(struct minimal_dev *mdev, u32 rx_ctrl)
+{
+    struct aq_cmd cmd = { .opcode = AQ_OPC_SET_RX_CTRL, .val = rx_ctrl };
+
+    return minimal_aq_exec(mdev, &cmd, NULL, NULL, 0);
+}
+
+static int minimal_aq_queue_op(struct minimal_dev *mdev, u16 opcode,
+                               u16 qtype)
+{
+    struct aq_cmd cmd = { .opcode = opcode, .qtype = qtype };
+
+    return minimal_aq_exec(mdev, &cmd, NULL, NULL, 0);
+}
+
+static int minimal_aq_destroy_queue(struct minimal_dev *mdev, u16 qtype)
+{
+    return minimal_aq_queue_op(mdev, AQ_OPC_DESTROY_QUEUE, qtype);
+}
+
+/* Fill one {lo, hi} perfect-match entry */
+static void minimal_uc_entry(u32 *entry, const u8 *addr)
+{
+    entry[0] = addr[0] | addr[1] << 8 | addr[2] << 16 | addr[3] << 24;
+    entry[1] = addr[4] | addr[5] << 8 | UC_ENTRY_VALID;
+}
+
+static u32 minimal_rx_ctrl(struct net_device *ndev, netdev_features_t features)
+{
+    struct minimal_dev *mdev = netdev_priv(ndev);
+    u32 rx_ctrl = 0;
+
+    if (mdev->hdr_split)
+        rx_ctrl |= RX_CTRL_HDR_SPLIT;
+
+    if (mdev->features & DEV_CAP_CQE_COMPRESS)
+        rx_ctrl |= RX_CTRL_CQE_COMPRESS;
+
+    if (ndev->flags & IFF_PROMISC)
+        rx_ctrl |= RX_CTRL_PROMISC;
+    else if (features & NETIF_F_HW_VLAN_CTAG_FILTER)
+        rx_ctrl |= RX_CTRL_VLAN_FILTER;
+
+    if (ndev->flags & IFF_ALLMULTI)
+        rx_ctrl |= RX_CTRL_ALLMULTI;
+
+    if (features & NETIF_F_HW_VLAN_CTAG_RX)
+        rx_ctrl |= RX_CTRL_VLAN_STRIP;
+
+    /* Slot 0 holds dev_addr, the rest must fit in the perfect-match table */
+    if (netdev_uc_count(ndev) > UC_TABLE_ENTRIES - 1)
+        rx_ctrl |= RX_CTRL_PROMISC;
+
+    return rx_ctrl;
+}
+
+static void minimal_set_rx_mode(struct net_device *ndev)
+{
+    struct minimal_dev *mdev = netdev_priv(ndev);
+    u32 uc_table[UC_TABLE_ENTRIES * 2] = { };
+    u32 mc_hash[MC_HASH_WORDS] = { };
+    struct netdev_hw_addr *ha;
+    u32 rx_ctrl, bit;
+    int i = 1;
+
+    rx_ctrl = minimal_rx_ctrl(ndev, ndev->features);
+
+    /* Unicast perfect-match table, unused slots stay invalid */
+    minimal_uc_entry(uc_table, ndev->dev_addr);
+    if (!(rx_ctrl & RX_CTRL_PROMISC)) {
+        netdev_for_each_uc_addr(ha, ndev)
+            minimal_uc_entry(uc_table + 2 * i++, ha->addr);
+    }
+    minimal_aq_set_filter(mdev, AQ_FILTER_UC, 0, uc_table,
+                          ARRAY_SIZE(uc_table));
+
+    /* Multicast hash: top 12 bits of the big-endian CRC pick the bit */
+    if (!(rx_ctrl & RX_CTRL_ALLMULTI)) {
+        netdev_for_each_mc_addr(ha, ndev) {
+            bit = ether_crc(ETH_ALEN, ha->addr) >> 20;
+            mc_hash[bit / 32] |= BIT(bit % 32);
+        }
+    }
+    if (memcmp(mc_hash, mdev->mc_hash, sizeof(mc_hash))) {
+        memcpy(mdev->mc_hash, mc_hash, sizeof(mc_hash));
+        minimal_aq_set_filter(mdev, AQ_FILTER_MC, 0, mc_hash, MC_HASH_WORDS);
+    }
+
+    minimal_aq_set_rx_ctrl(mdev, rx_ctrl);
+}
+
+static int minimal_set_mac_address(struct net_device *ndev, void *p)
+{
+    struct minimal_dev *mdev = netdev_priv(ndev);
+    u32 entry[2];
+    int ret;
+
+    ret = eth_mac_addr(ndev, p);
+    if (ret)
+        return ret;
+
+    minimal_uc_entry(entry, ndev->dev_addr);
+    return minimal_aq_set_filter(mdev, AQ_FILTER_UC, 0, entry, 2);
+}
+
+static int minimal_write_vlan_word(struct minimal_dev *mdev, u16 vid)
+{
+    return minimal_aq_set_filter(mdev, AQ_FILTER_VLAN, vid / 32,
+                                 &mdev->vlan_table[vid / 32], 1);
+}
+
+static int minimal_vlan_rx_add_vid(struct net_device *ndev,
+                                   __be16 proto, u16 vid)
+{
+    struct minimal_dev *mdev = netdev_priv(ndev);
+
+    mdev->vlan_table[vid / 32] |= BIT(vid % 32);
+    return minimal_write_vlan_word(mdev, vid);
+}
+
+static int minimal_vlan_rx_kill_vid(struct net_device *ndev,
+                                    __be16 proto, u16 vid)
+{
+    struct minimal_dev *mdev = netdev_priv(ndev);
+
+    mdev->vlan_table[vid / 32] &= ~BIT(vid % 32);
+    return minimal_write_vlan_word(mdev, vid);
+}
+
+static int minimal_set_features(struct net_device *ndev,
+                                netdev_features_t features)
+{
+    struct minimal_dev *mdev = netdev_priv(ndev);
+
+    if (features & NETIF_F_LOOPBACK)
+        mdev->lb_ctrl |= LB_CTRL_LOOPBACK;
+    else
+        mdev->lb_ctrl &= ~LB_CTRL_LOOPBACK;
+    writel(mdev->lb_ctrl, mdev->bar0 + REG_LB_CTRL);
+
+    return minimal_aq_set_rx_ctrl(mdev, minimal_rx_ctrl(ndev, features));
+}
+
+/* Consistent copy of the NIC's last counter snapshot */
+static void minimal_read_stats(struct minimal_dev *mdev, struct stats_page *snap)
+{
+    u32 seq;
+
+    do {
+        seq = READ_ONCE(mdev->stats->seq);
+        dma_rmb();
+        *snap = *mdev->stats;
+        dma_rmb();
+    } while ((seq & 1) || seq != READ_ONCE(mdev->stats->seq));
+}
+
+/* Software counters, plus the drops only the NIC can see: no MMIO */
+static void minimal_get_stats64(struct net_device *ndev,
+                                struct rtnl_link_stats64 *stats)
+{
+    struct minimal_dev *mdev = netdev_priv(ndev);
+    struct stats_page snap;
+
+    netdev_stats_to_stats64(stats, &ndev->stats);
+
+    if (!mdev->stats)
+        return;
+
+    minimal_read_stats(mdev, &snap);
+    stats->rx_length_errors = snap.rx_len_errors;
+    stats->rx_errors += snap.rx_len_errors;
+    stats->tx_errors += snap.tx_errors;
+}
+
+static int minimal_open(struct net_device *ndev)
+{
+    struct minimal_dev *mdev = netdev_priv(ndev);
+    const struct cpumask *mask;
+
+    napi_enable(&mdev->rx_napi);
+    napi_enable(&mdev->tx_napi);
+
+    /* Expose queue <-> NAPI mapping for busy polling and netlink */
+    netif_queue_set_napi(ndev, 0, NETDEV_QUEUE_TYPE_RX, &mdev->rx_napi);
+    netif_queue_set_napi(ndev, 0, NETDEV_QUEUE_TYPE_TX, &mdev->tx_napi);
+
+    /* XPS: transmit from the CPUs that take the TX completion interrupt */
+    mask = pci_irq_get_affinity(mdev->pdev, mdev->tx_vector);
+    if (mask)
+        netif_set_xps_queue(ndev, mask, 0);
+
+    writel(BIT(mdev->rx_vector) | BIT(mdev->tx_vector),
+           mdev->bar0 + REG_IRQ_MASK_CLR);
+    netif_start_queue(ndev);
+
+    mdev->tx_last_head = 0;
+    mdev->tx_last_tail = 0;
+    mdev->rx_last_ready = false;
+    mdev->rx_starved = 0;
+    schedule_delayed_work(&mdev->health_work, HEALTH_INTERVAL);
+    return 0;
+}
+
+static int minimal_stop(struct net_device *ndev)
+{
+    struct minimal_dev *mdev = netdev_priv(ndev);
+
+    /* Already quiesced by a ring rebuild that could not be completed */
+    if (!netif_device_present(ndev))
+        return 0;
+
+    /* Not _sync: the check takes rtnl, which the caller holds */
+    cancel_delayed_work(&mdev->health_work);
+
+    netif_tx_disable(ndev);
+    writel(BIT(mdev->rx_vector) | BIT(mdev->tx_vector),
+           mdev->bar0 + REG_IRQ_MASK_SET);
+
+    netif_queue_set_napi(ndev, 0, NETDEV_QUEUE_TYPE_RX, NULL);
+    netif_queue_set_napi(ndev, 0, NETDEV_QUEUE_TYPE_TX, NULL);
+
+    napi_disable(&mdev->tx_napi);
+    napi_disable(&mdev->rx_napi);
+    return 0;
+}
+
+/* vring_need_event() on ring positions: did old -> new step over event? */
+static bool minimal_need_event(u32 event, u32 new, u32 old, u32 size)
+{
+    return (new + 2 * size - event - 1) % size < (new + size - old) % size;
+}
+
+static u32 minimal_tx_free(struct minimal_dev *mdev)
+{
+    return (mdev->tx_clean + mdev->tx_ring_size - mdev->tx_tail - 1) %
+           mdev->tx_ring_size;
+}
+
+/*
+ * Write the descriptor and the head of the frame into the NIC's LLQ slot.
+ * Small frames go entirely inline and are never read from host memory.
+ */
+static void minimal_tx_push(struct minimal_dev *mdev, struct tx_desc *desc)
+{
+    void __iomem *entry = mdev->llq + mdev->tx_tail * LLQ_ENTRY_SIZE;
+    void *buf = mdev->tx_bufs[mdev->tx_tail];
+
+    desc->hdr_len = min_t(u16, desc->len, LLQ_HDR_MAX);
+    desc->addr = mdev->tx_bufs_dma[mdev->tx_tail] + desc->hdr_len;
+
+    memcpy_toio(entry, desc, sizeof(*desc));
+    memcpy_toio(entry + sizeof(*desc), buf, desc->hdr_len);
+}
+
+static netdev_tx_t minimal_start_xmit(struct sk_buff *skb,
+                                      struct net_device *ndev)
+{
+    struct minimal_dev *mdev = netdev_priv(ndev);
+    struct tx_desc *desc = &mdev->tx_ring[mdev->tx_tail];
+    u32 old_tail;
+
+    if (skb->len > mdev->buf_size) {
+        ndev->stats.tx_dropped++;
+        dev_kfree_skb_any(skb);
+        return NETDEV_TX_OK;
+    }
+
+    /* Frame is copied into the slot's coherent buffer, the skb can go now */
+    skb_copy_bits(skb, 0, mdev->tx_bufs[mdev->tx_tail], skb->len);
+    desc->len = skb->len;
+    desc->flags = 0;
+    desc->hdr_len = 0;
+    if (skb_vlan_tag_present(skb)) {
+        desc->flags = TX_VLAN_INSERT;
+        desc->vlan_tci = skb_vlan_tag_get(skb);
+    }
+
+    if (mdev->llq)
+        minimal_tx_push(mdev, desc);
+
+    ndev->stats.tx_packets++;
+    ndev->stats.tx_bytes += skb->len;
+    dev_kfree_skb_any(skb);
+
+    old_tail = mdev->tx_tail;
+    mdev->tx_tail = (mdev->tx_tail + 1) % mdev->tx_ring_size;
+
+    /*
+     * Descriptor must be visible before the doorbell; a full wmb() also
+     * flushes the write-combining buffers holding an LLQ push.
+     */
+    if (mdev->llq)
+        wmb();
+    else
+        dma_wmb();
+    if (!mdev->event) {
+        writel(mdev->tx_tail, mdev->bar0 + QREG(0, QREG_TX_TAIL));
+    } else {
+        WRITE_ONCE(mdev->event->tx_tail, mdev->tx_tail);
+        /* Publish the tail before looking at what the NIC asked for */
+        mb();
+        if (minimal_need_event(READ_ONCE(mdev->event->tx_avail_event),
+                               mdev->tx_tail, old_tail, mdev->tx_ring_size))
+            writel(mdev->tx_tail, mdev->bar0 + QREG(0, QREG_TX_TAIL));
+    }
+
+    if (!minimal_tx_free(mdev)) {
+        netif_stop_queue(ndev);
+        /* Pairs with the barrier in minimal_tx_clean() */
+        smp_mb();
+        if (minimal_tx_free(mdev))
+            netif_wake_queue(ndev);
+    }
+
+    return NETDEV_TX_OK;
+}
+
+static bool minimal_cqe_ready(struct cq_entry *cq, u32 idx, u16 phase)
+{
+    return (READ_ONCE(cq[idx].flags) & CQE_PHASE) == phase;
+}
+
+/* Advance a CQ consumer index, flipping the expected phase on wrap */
+static void minimal_cq_next(u32 *idx, u16 *phase, u32 size)
+{
+    if (++*idx == size) {
+        *idx = 0;
+        *phase ^= CQE_PHASE;
+    }
+}
+
+/* Reclaim descriptors the NIC has finished sending */
+static void minimal_tx_clean(struct minimal_dev *mdev)
+{
+    /* TX completes in order, so the CQ index is the ring slot */
+    while (mdev->tx_clean != mdev->tx_tail &&
+           minimal_cqe_ready(mdev->tx_cq, mdev->tx_clean, mdev->tx_phase))
+        minimal_cq_next(&mdev->tx_clean, &mdev->tx_phase, mdev->tx_ring_size);
+
+    /* Pairs with the barrier in minimal_start_xmit() */
+    smp_mb();
+    if (netif_queue_stopped(mdev->netdev) && minimal_tx_free(mdev))
+        netif_wake_queue(mdev->netdev);
+}
+
+static int minimal_rx_map_page(struct minimal_dev *mdev, int i)
+{
+    struct page *page;
+    dma_addr_t dma;
+
+    /* Header split pages come from the pool, already mapped */
+    if (mdev->page_pool) {
+        page = page_pool_dev_alloc_pages(mdev->page_pool);
+        if (!page)
+            return -ENOMEM;
+        dma = page_pool_get_dma_addr(page);
+        goto out;
+    }
+
+    page = dev_alloc_pages(mdev->rx_page_order);
+    if (!page)
+        return -ENOMEM;
+
+    dma = dma_map_page(&mdev->pdev->dev, page, 0,
+                       PAGE_SIZE << mdev->rx_page_order, DMA_FROM_DEVICE);
+    if (dma_mapping_error(&mdev->pdev->dev, dma)) {
+        __free_pages(page, mdev->rx_page_order);
+        return -ENOMEM;
+    }
+
+out:
+    mdev->rx_pages[i] = page;
+    mdev->rx_pages_dma[i] = dma;
+    mdev->rx_ring[i].addr = dma;
+    return 0;
+}
+
+/*
+ * Header split: headers are copied into the skb head and the payload
+ * page is attached as a frag; minimal_rx_refill() gives the slot a new
+ * page from the pool. Frames up to rx_copybreak, and frames the NIC
+ * could not parse, are copied whole so the page stays posted.
+ */
+static struct sk_buff *minimal_rx_split_skb(struct minimal_dev *mdev, int i,
+                                            struct cq_entry *cqe)
+{
+    struct device *dev = &mdev->pdev->dev;
+    struct page *page = mdev->rx_pages[i];
+    dma_addr_t dma = mdev->rx_pages_dma[i];
+    u16 hdr_len = (cqe->flags & RX_SPLIT) ? cqe->hdr_len : 0;
+    u16 payload = cqe->len - hdr_len;
+    struct sk_buff *skb;
+
+    if (!hdr_len || cqe->len <= READ_ONCE(rx_copybreak)) {
+        skb = napi_alloc_skb(&mdev->rx_napi, cqe->len);
+        if (!skb)
+            return NULL;
+        skb_put_data(skb, mdev->rx_hdr_bufs + i * RX_HDR_SIZE, hdr_len);
+        if (payload) {
+            dma_sync_single_for_cpu(dev, dma, payload, DMA_FROM_DEVICE);
+            skb_put_data(skb, page_address(page), payload);
+            dma_sync_single_for_device(dev, dma, payload, DMA_FROM_DEVICE);
+        }
+        return skb;
+    }
+
+    skb = napi_alloc_skb(&mdev->rx_napi, hdr_len);
+    if (!skb)
+        return NULL;
+    skb_put_data(skb, mdev->rx_hdr_bufs + i * RX_HDR_SIZE, hdr_len);
+
+    dma_sync_single_for_cpu(dev, dma, payload, DMA_FROM_DEVICE);
+    skb_add_rx_frag(skb, 0, page, 0, payload, PAGE_SIZE);
+    skb_mark_for_recycle(skb);
+    mdev->rx_pages[i] = NULL;
+    return skb;
+}
+
+/*
+ * Striding RX: frames are copied out of their strides, so the buffer is
+ * never shared with the stack and stays mapped for the life of the ring.
+ */
+static struct sk_buff *minimal_rx_stride_skb(struct minimal_dev *mdev, int i,
+                                             struct cq_entry *cqe)
+{
+    u32 off = cqe->stride * RX_STRIDE_SIZE;
+    struct sk_buff *skb;
+
+    dma_sync_single_range_for_cpu(&mdev->pdev->dev, mdev->rx_pages_dma[i],
+                                  off, cqe->len, DMA_FROM_DEVICE);
+
+    skb = napi_alloc_skb(&mdev->rx_napi, cqe->len);
+    if (skb)
+        skb_put_data(skb, page_address(mdev->rx_pages[i]) + off, cqe->len);
+    return skb;
+}
+
+/*
+ * Fill the header split slots of the next n descriptors from tail with
+ * pool pages in one go, before any of them is posted. page_pool refills
+ * its own cache with a bulk page allocation when it runs dry. Returns the
+ * number of leading slots that are ready to post.
+ */
+static u32 minimal_rx_alloc_batch(struct minimal_dev *mdev, u32 tail, u32 n)
+{
+    u32 i, idx;
+
+    if (!mdev->page_pool)
+        return n;
+
+    for (i = 0; i < n; i++) {
+        idx = (tail + i) % mdev->rx_ring_size;
+        if (!mdev->rx_pages[idx] && minimal_rx_map_page(mdev, idx))
+            break;
+    }
+    return i;
+}
+
+/*
+ * Repost consumed descriptors from rx_tail on, giving header split slots
+ * whose page went up the stack a new one. The tail is only published once
+ * a batch is ready, or with flush when the queue has gone idle, so busy
+ * traffic costs one doorbell per rx_refill_batch frames. Returns false if
+ * a page allocation failed and slots are still waiting.
+ */
+static bool minimal_rx_refill(struct minimal_dev *mdev, bool flush)
+{
+    u32 old_tail = mdev->rx_tail;
+    u32 ready;
+
+    if (!mdev->rx_refill ||
+        (!flush && mdev->rx_refill < mdev->rx_refill_batch))
+        return true;
+
+    ready = minimal_rx_alloc_batch(mdev, old_tail, mdev->rx_refill);
+    if (!ready)
+        return false;
+    mdev->rx_refill -= ready;
+    mdev->rx_tail = (old_tail + ready) % mdev->rx_ring_size;
+
+    /* Reposted descriptors must be visible before the new tail */
+    dma_wmb();
+    if (!mdev->event) {
+        writel(mdev->rx_tail, mdev->bar0 + QREG(0, QREG_RX_TAIL));
+        return !mdev->rx_refill;
+    }
+
+    /* Only ring the doorbell if the NIC ran dry and is waiting for it */
+    WRITE_ONCE(mdev->event->rx_tail, mdev->rx_tail);
+    mb();
+    if (minimal_need_event(READ_ONCE(mdev->event->rx_avail_event),
+                           mdev->rx_tail, old_tail, mdev->rx_ring_size))
+        writel(mdev->rx_tail, mdev->bar0 + QREG(0, QREG_RX_TAIL));
+    return !mdev->rx_refill;
+}
+
+/* Does the completion stay inside the buffer it names? */
+static bool minimal_rx_cqe_valid(struct minimal_dev *mdev,
+                                 const struct cq_entry *cqe)
+{
+    u16 hdr_len = (cqe->flags & RX_SPLIT) ? cqe->hdr_len : 0;
+
+    if (cqe->id >= mdev->rx_ring_size)
+        return false;
+    if (mdev->rx_strides)
+        return (u32)cqe->stride * RX_STRIDE_SIZE + cqe->len <=
+               mdev->rx_strides * RX_STRIDE_SIZE;
+    if (mdev->hdr_split)
+        return hdr_len <= RX_HDR_SIZE && hdr_len <= cqe->len &&
+               cqe->len - hdr_len <= PAGE_SIZE;
+    return cqe->len <= mdev->buf_size;
+}
+
+/*
+ * Hand one completed frame to the stack. Returns the number of
+ * submission slots it gave back to the driver.
+ */
+static int minimal_rx_frame(struct minimal_dev *mdev, struct cq_entry *cqe)
+{
+    struct net_device *ndev = mdev->netdev;
+    struct sk_buff *skb;
+    int i = cqe->id, posted = 0;
+
+    netdev_dbg(ndev, "RX packet len=%u\n", cqe->len);
+
+    /* Never index the rings with what a broken NIC wrote */
+    if (!minimal_rx_cqe_valid(mdev, cqe)) {
+        if (net_ratelimit())
+            netdev_err(ndev, "bad RX completion id=%u len=%u stride=%u\n",
+                       cqe->id, cqe->len, cqe->stride);
+        ndev->stats.rx_errors++;
+        /* The slot was still consumed in ring order */
+        return mdev->rx_strides ? !!(cqe->flags & RX_BUF_LAST) : 1;
+    }
+
+    if (mdev->rx_strides) {
+        /* A zero-length filler only hands the buffer back */
+        skb = cqe->len ? minimal_rx_stride_skb(mdev, i, cqe) : NULL;
+        if (cqe->flags & RX_BUF_LAST) {
+            dma_sync_single_for_device(&mdev->pdev->dev,
+                                       mdev->rx_pages_dma[i],
+                                       PAGE_SIZE << mdev->rx_page_order,
+                                       DMA_FROM_DEVICE);
+            posted++;
+        }
+        if (!cqe->len)
+            return posted;
+    } else if (mdev->hdr_split) {
+        skb = minimal_rx_split_skb(mdev, i, cqe);
+    } else {
+        skb = napi_alloc_skb(&mdev->rx_napi, cqe->len);
+        if (skb)
+            skb_put_data(skb, mdev->rx_bufs[i], cqe->len);
+    }
+
+    /* Without striding every completion frees its submission slot */
+    if (!mdev->rx_strides)
+        posted++;
+
+    if (skb) {
+        skb->protocol = eth_type_trans(skb, ndev);
+        if (cqe->flags & RX_VLAN)
+            __vlan_hwaccel_put_tag(skb, htons(ETH_P_8021Q), cqe->vlan_tci);
+        ndev->stats.rx_packets++;
+        ndev->stats.rx_bytes += cqe->len;
+        napi_gro_receive(&mdev->rx_napi, skb);
+    } else {
+        ndev->stats.rx_dropped++;
+    }
+
+    return posted;
+}
+
+/*
+ * Expand a compressed block: the title describes the first frame, the
+ * entries after it hold the lengths of the rest. Everything else is
+ * implied: the next ring slot, or the next free stride when striding.
+ */
+static int minimal_rx_block(struct minimal_dev *mdev, struct cq_entry *title)
+{
+    struct cq_entry cqe = *title;
+    u16 lens[CQE_MINI_PER_ENTRY + 1];
+    int j, k, n = title->hdr_len, posted;
+
+    cqe.flags &= ~CQE_COMPRESSED;
+    cqe.hdr_len = 0;
+    posted = minimal_rx_frame(mdev, &cqe);
+
+    for (k = 1; k < n; k++) {
+        if ((k - 1) % CQE_MINI_PER_ENTRY == 0) {
+            memcpy(lens, &mdev->rx_cq[mdev->rx_next], sizeof(lens));
+            minimal_cq_next(&mdev->rx_next, &mdev->rx_phase, mdev->rx_cq_size);
+        }
+
+        if (mdev->rx_strides)
+            cqe.stride += DIV_ROUND_UP(cqe.len, RX_STRIDE_SIZE);
+        else
+            cqe.id = (cqe.id + 1) % mdev->rx_ring_size;
+        j = (k - 1) % CQE_MINI_PER_ENTRY;
+        cqe.len = lens[j < CQE_MINI_FLAGS ? j : j + 1];
+
+        posted += minimal_rx_frame(mdev, &cqe);
+    }
+
+    return posted;
+}
+
+/*
+ * Hand up to budget RX completions to the stack. Completions are read
+ * linearly from the CQ; the submission ring is never written by the NIC,
+ * so slots only change when a buffer is replaced.
+ */
+static int minimal_rx(struct minimal_dev *mdev, int budget)
+{
+    struct cq_entry cqe;
+    int n, work = 0, posted = 0;
+
+    while (work < budget) {
+        if (!minimal_cqe_ready(mdev->rx_cq, mdev->rx_next, mdev->rx_phase))
+            break;
+
+        /* Read the rest of the entry only after seeing the phase flip */
+        dma_rmb();
+
+        cqe = mdev->rx_cq[mdev->rx_next];
+        n = (cqe.flags & CQE_COMPRESSED) ? cqe.hdr_len : 1;
+
+        /*
+         * A block is consumed whole. Leave it for the next poll unless
+         * it is the first thing seen, so a small busy-poll budget still
+         * makes progress; NAPI only needs to see budget back.
+         */
+        if (work && work + n > budget) {
+            work = budget;
+            break;
+        }
+
+        minimal_cq_next(&mdev->rx_next, &mdev->rx_phase, mdev->rx_cq_size);
+        if (n > 1)
+            posted += minimal_rx_block(mdev, &cqe);
+        else
+            posted += minimal_rx_frame(mdev, &cqe);
+        work += n;
+    }
+
+    /* Below budget the queue is idle: post everything, not just a batch */
+    mdev->rx_refill += posted;
+    if (!minimal_rx_refill(mdev, work < budget))
+        return budget;      // out of pages: stay in polling and retry
+
+    return min(work, budget);
+}
+
+/*
+ * NAPI poll. The RX vector stays masked in the NIC for as long as the
+ * queue is being polled, whether from softirq or from a busy-polling
+ * socket; napi_complete_done() returns false when napi_defer_hard_irqs
+ * or gro_flush_timeout want polling to continue, so only unmask when it
+ * really hands the queue back to interrupts.
+ */
+static int minimal_rx_poll(struct napi_struct *napi, int budget)
+{
+    struct minimal_dev *mdev = container_of(napi, struct minimal_dev, rx_napi);
+    int work;
+
+    work = minimal_rx(mdev, budget);
+
+    if (work < budget && napi_complete_done(napi, work)) {
+        if (!mdev->event) {
+            writel(BIT(mdev->rx_vector), mdev->bar0 + REG_IRQ_MASK_CLR);
+            return work;
+        }
+
+        /* No MMIO: ask for an interrupt when rx_next completes */
+        WRITE_ONCE(mdev->event->rx_used_event, mdev->rx_next);
+        mb();
+        /* A frame completed before the NIC saw the new event index */
+        if (minimal_cqe_ready(mdev->rx_cq, mdev->rx_next, mdev->rx_phase))
+            napi_schedule(napi);
+    }
+
+    return work;
+}
+
+static int minimal_tx_poll(struct napi_struct *napi, int budget)
+{
+    struct minimal_dev *mdev = container_of(napi, struct minimal_dev, tx_napi);
+
+    minimal_tx_clean(mdev);
+
+    if (napi_complete_done(napi, 0)) {
+        if (!mdev->event) {
+            writel(BIT(mdev->tx_vector), mdev->bar0 + REG_IRQ_MASK_CLR);
+            return 0;
+        }
+
+        /*
+         * Frames are copied at xmit time, so reclaim can be lazy: only
+         * interrupt once half the ring has completed past tx_clean.
+         */
+        WRITE_ONCE(mdev->event->tx_used_event,
+                   (mdev->tx_clean + mdev->tx_ring_size / 2) %
+                   mdev->tx_ring_size);
+        mb();
+        if (mdev->tx_clean != mdev->tx_tail &&
+            minimal_cqe_ready(mdev->tx_cq, mdev->tx_clean, mdev->tx_phase))
+            napi_schedule(napi);
+    }
+
+    return 0;
+}
+
+static irqreturn_t minimal_rx_irq(int irq, void *dev_id)
+{
+    struct minimal_vec *vec = dev_id;
+    struct minimal_dev *mdev = vec->mdev;
+
+    /* With event_idx the NIC stays quiet until the next used_event */
+    if (napi_schedule_prep(&mdev->rx_napi)) {
+        if (!mdev->event)
+            writel(BIT(mdev->rx_vector), mdev->bar0 + REG_IRQ_MASK_SET);
+        __napi_schedule(&mdev->rx_napi);
+    }
+    return IRQ_HANDLED;
+}
+
+static irqreturn_t minimal_tx_irq(int irq, void *dev_id)
+{
+    struct minimal_vec *vec = dev_id;
+    struct minimal_dev *mdev = vec->mdev;
+
+    if (napi_schedule_prep(&mdev->tx_napi)) {
+        if (!mdev->event)
+            writel(BIT(mdev->tx_vector), mdev->bar0 + REG_IRQ_MASK_SET);
+        __napi_schedule(&mdev->tx_napi);
+    }
+    return IRQ_HANDLED;
+}
+
+/* Single vector: RX and TX completions share it, and so does its mask bit */
+static irqreturn_t minimal_rxtx_irq(int irq, void *dev_id)
+{
+    minimal_rx_irq(irq, dev_id);
+    return minimal_tx_irq(irq, dev_id);
+}
+
+/* Remaining vectors are only raised by the BAR0 offset 0 test register */
+static irqreturn_t minimal_irq_handler(int irq, void *dev_id)
+{
+    struct minimal_vec *vec = dev_id;
+
+    /* Debug only: the guest can fire these as fast as it writes BAR0 */
+    netdev_dbg(vec->mdev->netdev, "test IRQ %d fired\n", irq);
+
+    return IRQ_HANDLED;
+}
+
+static irq_handler_t minimal_vector_handler(struct minimal_dev *mdev, int vector)
+{
+    struct minimal_vec *vec = &mdev->vecs[vector];
+    const char *dev = pci_name(mdev->pdev);
+
+    vec->mdev = mdev;
+
+    if (vector == mdev->rx_vector && vector == mdev->tx_vector) {
+        snprintf(vec->name, sizeof(vec->name), "%s-rxtx-0", dev);
+        return minimal_rxtx_irq;
+    }
+    if (vector == mdev->rx_vector) {
+        snprintf(vec->name, sizeof(vec->name), "%s-rx-0", dev);
+        return minimal_rx_irq;
+    }
+    if (vector == mdev->tx_vector) {
+        snprintf(vec->name, sizeof(vec->name), "%s-tx-0", dev);
+        return minimal_tx_irq;
+    }
+    snprintf(vec->name, sizeof(vec->name), "%s-test-%d", dev, vector);
+    return minimal_irq_handler;
+}
+
+/* Copy buffer size for RX (plain mode) and TX slots at a given MTU */
+static u32 minimal_buf_size(unsigned int mtu)
+{
+    return max_t(u32, RX_BUF_SIZE, mtu + ETH_HLEN + VLAN_HLEN);
+}
+
+/*
+ * Header split and striding receive into fixed page or stride buffers,
+ * so only the plain copy mode can size its buffers for jumbo frames.
+ */
+static unsigned int minimal_max_mtu(struct minimal_dev *mdev)
+{
+    unsigned int buf;
+
+    if (mdev->rx_strides)
+        buf = mdev->rx_strides * RX_STRIDE_SIZE;
+    else if (mdev->hdr_split)
+        buf = PAGE_SIZE;
+    else
+        return JUMBO_MTU;
+
+    return clamp_t(unsigned int, buf - ETH_HLEN - VLAN_HLEN,
+                   ETH_DATA_LEN, JUMBO_MTU);
+}
+
+/*
+ * Allocate both rings, their buffers and completion queues for the
+ * current ring sizes and MTU. On failure, whatever was allocated is left
+ * for minimal_free_rings().
+ */
+static int minimal_alloc_rings(struct minimal_dev *mdev)
+{
+    struct device *dev = &mdev->pdev->dev;
+    u32 i;
+
+    mdev->buf_size = minimal_buf_size(mdev->netdev->mtu);
+    mdev->rx_cq_size = mdev->rx_ring_size * (mdev->rx_strides ?: 1);
+
+    mdev->rx_ring = dma_alloc_coherent(dev,
+            sizeof(struct rx_desc) * mdev->rx_ring_size,
+            &mdev->rx_ring_dma, GFP_KERNEL);
+    mdev->rx_bufs = kcalloc(mdev->rx_ring_size, sizeof(*mdev->rx_bufs),
+                            GFP_KERNEL);
+    mdev->rx_bufs_dma = kcalloc(mdev->rx_ring_size,
+                                sizeof(*mdev->rx_bufs_dma), GFP_KERNEL);
+    mdev->rx_pages = kcalloc(mdev->rx_ring_size, sizeof(*mdev->rx_pages),
+                             GFP_KERNEL);
+    mdev->rx_pages_dma = kcalloc(mdev->rx_ring_size,
+                                 sizeof(*mdev->rx_pages_dma), GFP_KERNEL);
+    if (!mdev->rx_ring || !mdev->rx_bufs || !mdev->rx_bufs_dma ||
+        !mdev->rx_pages || !mdev->rx_pages_dma)
+        return -ENOMEM;
+
+    if (mdev->rx_strides) {
+        /* One multi-page buffer per descriptor, divided into strides */
+        mdev->rx_page_order = get_order(mdev->rx_strides * RX_STRIDE_SIZE);
+        for (i = 0; i < mdev->rx_ring_size; i++) {
+            if (minimal_rx_map_page(mdev, i))
+                return -ENOMEM;
+            mdev->rx_ring[i].len = mdev->rx_strides * RX_STRIDE_SIZE;
+        }
+    } else if (mdev->hdr_split) {
+        /* One 256-byte header slot per descriptor, payload in its own page */
+        struct page_pool_params pp = {
+            .flags = PP_FLAG_DMA_MAP | PP_FLAG_DMA_SYNC_DEV,
+            .order = 0,
+            .pool_size = mdev->rx_ring_size,
+            .nid = dev_to_node(dev),
+            .dev = dev,
+            .napi = &mdev->rx_napi,
+            .dma_dir = DMA_FROM_DEVICE,
+            .max_len = PAGE_SIZE,
+        };
+
+        mdev->rx_page_order = 0;
+        mdev->page_pool = page_pool_create(&pp);
+        if (IS_ERR(mdev->page_pool)) {
+            int ret = PTR_ERR(mdev->page_pool);
+
+            mdev->page_pool = NULL;
+            return ret;
+        }
+        mdev->rx_hdr_bufs = dma_alloc_coherent(dev,
+                RX_HDR_SIZE * mdev->rx_ring_size,
+                &mdev->rx_hdr_dma, GFP_KERNEL);
+        if (!mdev->rx_hdr_bufs)
+            return -ENOMEM;
+
+        for (i = 0; i < mdev->rx_ring_size; i++) {
+            if (minimal_rx_map_page(mdev, i))
+                return -ENOMEM;
+            mdev->rx_ring[i].hdr_addr = mdev->rx_hdr_dma + i * RX_HDR_SIZE;
+            mdev->rx_ring[i].len = PAGE_SIZE;
+        }
+    } else {
+        /* One coherent copy buffer per descriptor, large enough for the MTU */
+        for (i = 0; i < mdev->rx_ring_size; i++) {
+            mdev->rx_bufs[i] = dma_alloc_coherent(dev, mdev->buf_size,
+                                                  &mdev->rx_bufs_dma[i],
+                                                  GFP_KERNEL);
+            if (!mdev->rx_bufs[i])
+                return -ENOMEM;
+
+            mdev->rx_ring[i].addr = mdev->rx_bufs_dma[i];
+            mdev->rx_ring[i].len = mdev->buf_size;
+        }
+    }
+
+    /* TX ring: same layout, the driver copies each frame into its slot */
+    mdev->tx_ring = dma_alloc_coherent(dev,
+            sizeof(struct tx_desc) * mdev->tx_ring_size,
+            &mdev->tx_ring_dma, GFP_KERNEL);
+    mdev->tx_bufs = kcalloc(mdev->tx_ring_size, sizeof(*mdev->tx_bufs),
+                            GFP_KERNEL);
+    mdev->tx_bufs_dma = kcalloc(mdev->tx_ring_size,
+                                sizeof(*mdev->tx_bufs_dma), GFP_KERNEL);
+    if (!mdev->tx_ring || !mdev->tx_bufs || !mdev->tx_bufs_dma)
+        return -ENOMEM;
+
+    for (i = 0; i < mdev->tx_ring_size; i++) {
+        mdev->tx_bufs[i] = dma_alloc_coherent(dev, mdev->buf_size,
+                                              &mdev->tx_bufs_dma[i],
+                                              GFP_KERNEL);
+        if (!mdev->tx_bufs[i])
+            return -ENOMEM;
+
+        mdev->tx_ring[i].addr = mdev->tx_bufs_dma[i];
+    }
+
+    /* Completion queues, zeroed so no entry carries the first pass's phase */
+    mdev->rx_cq = dma_alloc_coherent(dev,
+            sizeof(struct cq_entry) * mdev->rx_cq_size,
+            &mdev->rx_cq_dma, GFP_KERNEL);
+    mdev->tx_cq = dma_alloc_coherent(dev,
+            sizeof(struct cq_entry) * mdev->tx_ring_size,
+            &mdev->tx_cq_dma, GFP_KERNEL);
+    if (!mdev->rx_cq || !mdev->tx_cq)
+        return -ENOMEM;
+
+    return 0;
+}
+
+/* Free everything minimal_alloc_rings() got, the NIC must not own the rings */
+static void minimal_free_rings(struct minimal_dev *mdev)
+{
+    struct device *dev = &mdev->pdev->dev;
+    u32 i;
+
+    for (i = 0; mdev->rx_bufs && i < mdev->rx_ring_size; i++) {
+        if (mdev->rx_bufs[i])
+            dma_free_coherent(dev, mdev->buf_size, mdev->rx_bufs[i],
+                              mdev->rx_bufs_dma[i]);
+    }
+
+    for (i = 0; mdev->rx_pages && i < mdev->rx_ring_size; i++) {
+        if (!mdev->rx_pages[i])
+            continue;
+        if (mdev->page_pool) {
+            page_pool_put_full_page(mdev->page_pool, mdev->rx_pages[i], false);
+            continue;
+        }
+        dma_unmap_page(dev, mdev->rx_pages_dma[i],
+                       PAGE_SIZE << mdev->rx_page_order, DMA_FROM_DEVICE);
+        __free_pages(mdev->rx_pages[i], mdev->rx_page_order);
+    }
+
+    /* Pages still held by the stack come back to the pool and are freed later */
+    if (mdev->page_pool)
+        page_pool_destroy(mdev->page_pool);
+
+    if (mdev->rx_hdr_bufs)
+        dma_free_coherent(dev, RX_HDR_SIZE * mdev->rx_ring_size,
+                          mdev->rx_hdr_bufs, mdev->rx_hdr_dma);
+    if (mdev->rx_ring)
+        dma_free_coherent(dev, sizeof(struct rx_desc) * mdev->rx_ring_size,
+                          mdev->rx_ring, mdev->rx_ring_dma);
+    if (mdev->rx_cq)
+        dma_free_coherent(dev, sizeof(struct cq_entry) * mdev->rx_cq_size,
+                          mdev->rx_cq, mdev->rx_cq_dma);
+
+    for (i = 0; mdev->tx_bufs && i < mdev->tx_ring_size; i++) {
+        if (mdev->tx_bufs[i])
+            dma_free_coherent(dev, mdev->buf_size, mdev->tx_bufs[i],
+                              mdev->tx_bufs_dma[i]);
+    }
+
+    if (mdev->tx_ring)
+        dma_free_coherent(dev, sizeof(struct tx_desc) * mdev->tx_ring_size,
+                          mdev->tx_ring, mdev->tx_ring_dma);
+    if (mdev->tx_cq)
+        dma_free_coherent(dev, sizeof(struct cq_entry) * mdev->tx_ring_size,
+                          mdev->tx_cq, mdev->tx_cq_dma);
+
+    kfree(mdev->rx_bufs);
+    kfree(mdev->rx_bufs_dma);
+    kfree(mdev->rx_pages);
+    kfree(mdev->rx_pages_dma);
+    kfree(mdev->tx_bufs);
+    kfree(mdev->tx_bufs_dma);
+
+    mdev->rx_ring = NULL;
+    mdev->rx_bufs = NULL;
+    mdev->rx_bufs_dma = NULL;
+    mdev->rx_pages = NULL;
+    mdev->rx_pages_dma = NULL;
+    mdev->rx_hdr_bufs = NULL;
+    mdev->page_pool = NULL;
+    mdev->rx_cq = NULL;
+    mdev->tx_ring = NULL;
+    mdev->tx_bufs = NULL;
+    mdev->tx_bufs_dma = NULL;
+    mdev->tx_cq = NULL;
+}
+
+/* Hand freshly allocated rings to the NIC, starting both from slot 0 */
+static int minimal_create_queues(struct minimal_dev *mdev)
+{
+    struct aq_cmd cmd;
+    int ret;
+
+    mdev->rx_next = 0;
+    mdev->rx_phase = CQE_PHASE;
+    mdev->tx_tail = 0;
+    mdev->tx_clean = 0;
+    mdev->tx_phase = CQE_PHASE;
+    mdev->rx_tail = mdev->rx_ring_size - 1;
+    mdev->rx_refill = 0;
+    mdev->rx_refill_batch = min_t(u32, RX_REFILL_BATCH, mdev->rx_ring_size / 4);
+
+    if (mdev->event) {
+        memset(mdev->event, 0, sizeof(*mdev->event));
+        mdev->event->rx_tail = mdev->rx_tail;
+    }
+
+    cmd = (struct aq_cmd) {
+        .opcode = AQ_OPC_CREATE_QUEUE,
+        .qtype = AQ_QTYPE_RX,
+        .addr = mdev->rx_ring_dma,
+        .ring_size = mdev->rx_ring_size,
+        .cq_addr = mdev->rx_cq_dma,
+        .hdr_size = RX_HDR_SIZE,
+        .stride_size = mdev->rx_strides ? RX_STRIDE_SIZE : 0,
+        .stride_num = mdev->rx_strides,
+        .vector = mdev->rx_vector,
+    };
+    ret = minimal_aq_exec(mdev, &cmd, NULL, NULL, 0);
+    if (ret)
+        return ret;
+
+    writel(mdev->rx_tail, mdev->bar0 + QREG(0, QREG_RX_TAIL));
+
+    cmd = (struct aq_cmd) {
+        .opcode = AQ_OPC_CREATE_QUEUE,
+        .qtype = AQ_QTYPE_TX,
+        .addr = mdev->tx_ring_dma,
+        .ring_size = mdev->tx_ring_size,
+        .cq_addr = mdev->tx_cq_dma,
+        .vector = mdev->tx_vector,
+    };
+    ret = minimal_aq_exec(mdev, &cmd, NULL, NULL, 0);
+    if (ret)
+        return ret;
+
+    /* LLQ needs a BAR4 slot for every TX descriptor, else use host memory */
+    if (mdev->llq_map &&
+        (u64)mdev->tx_ring_size * LLQ_ENTRY_SIZE <= mdev->llq_len) {
+        mdev->llq = mdev->llq_map;
+        writel(TX_CTRL_LLQ, mdev->bar0 + REG_TX_CTRL);
+    } else {
+        mdev->llq = NULL;
+        writel(0, mdev->bar0 + REG_TX_CTRL);
+    }
+
+    return 0;
+}
+
+static void minimal_destroy_queues(struct minimal_dev *mdev)
+{
+    minimal_aq_destroy_queue(mdev, AQ_QTYPE_RX);
+    minimal_aq_destroy_queue(mdev, AQ_QTYPE_TX);
+}
+
+/*
+ * Rebuild both rings for new sizes or a new MTU, as a down/up of the
+ * interface would. If the new layout can't be allocated, the old one is
+ * put back; if even that fails the device is detached until a later
+ * rebuild succeeds.
+ */
+static int minimal_reconfigure(struct minimal_dev *mdev, u32 rx_size,
+                               u32 tx_size, unsigned int mtu)
+{
+    struct net_device *ndev = mdev->netdev;
+    u32 old_rx = mdev->rx_ring_size, old_tx = mdev->tx_ring_size;
+    unsigned int old_mtu = ndev->mtu;
+    bool running = netif_running(ndev);
+    int ret, err;
+
+    if (running)
+        minimal_stop(ndev);
+
+    minimal_destroy_queues(mdev);
+    minimal_free_rings(mdev);
+
+    mdev->rx_ring_size = rx_size;
+    mdev->tx_ring_size = tx_size;
+    WRITE_ONCE(ndev->mtu, mtu);
+    ret = minimal_alloc_rings(mdev);
+    if (ret) {
+        netdev_err(ndev, "no memory for %u/%u descriptors, keeping %u/%u\n",
+                   rx_size, tx_size, old_rx, old_tx);
+        minimal_free_rings(mdev);
+        mdev->rx_ring_size = old_rx;
+        mdev->tx_ring_size = old_tx;
+        WRITE_ONCE(ndev->mtu, old_mtu);
+        err = minimal_alloc_rings(mdev);
+        if (!err)
+            err = minimal_create_queues(mdev);
+        if (err) {
+            netdev_err(ndev, "rings lost, device detached: %d\n", err);
+            minimal_free_rings(mdev);
+            netif_device_detach(ndev);
+            return err;
+        }
+    } else {
+        ret = minimal_create_queues(mdev);
+        if (ret) {
+            minimal_free_rings(mdev);
+            netif_device_detach(ndev);
+            return ret;
+        }
+    }
+
+    netif_device_attach(ndev);
+    if (running)
+        minimal_open(ndev);
+    return ret;
+}
 
-/* QEMU NIC reads and writes exactly this layout using PCIe DMA */
-struct rx_desc {
-    u64 addr;   // where NIC must DMA the packet
-    u16 len;    // length written by NIC
-    u16 flags;  // DONE bit from NIC
-};
+static int minimal_change_mtu(struct net_device *ndev, int new_mtu)
+{
+    struct minimal_dev *mdev = netdev_priv(ndev);
+    struct aq_cmd cmd = { .opcode = AQ_OPC_SET_MTU, .val = new_mtu };
+    int ret;
 
-struct minimal_dev {
-    struct pci_dev *pdev;
-    void __iomem *bar0;    // MMIO registers
-    void __iomem *bar1;    // MSI-X table/PBA (optional mapping)
-    int nvec_irq;
-    struct net_device *netdev;
+    ret = minimal_aq_exec(mdev, &cmd, NULL, NULL, 0);
+    if (ret)
+        return ret;
 
-    struct rx_desc *rx_ring;   // Virtual address where Linux sees the descriptor ring
-    dma_addr_t rx_ring_dma;     // Physical address QEMU NIC uses to access ring
+    if (minimal_buf_size(new_mtu) == mdev->buf_size) {
+        WRITE_ONCE(ndev->mtu, new_mtu);
+        return 0;
+    }
 
-    void *rx_bufs[RX_RING_SIZE];    // Actual packet buffers linux will use to access data
-    dma_addr_t rx_bufs_dma[RX_RING_SIZE];   // Physical addresses of those buffers
-};
+    /* Buffers are sized for the MTU: rebuild the rings around them */
+    ret = minimal_reconfigure(mdev, mdev->rx_ring_size, mdev->tx_ring_size,
+                              new_mtu);
+    if (ret) {
+        cmd = (struct aq_cmd) { .opcode = AQ_OPC_SET_MTU, .val = ndev->mtu };
+        minimal_aq_exec(mdev, &cmd, NULL, NULL, 0);
+    }
+    return ret;
+}
 
-static int minimal_open(struct net_device *ndev)
+/*
+ * Recover one queue in place: stop it in the NIC, rewind the driver's
+ * side while the NIC leaves the ring alone, then have the NIC rewind and
+ * restart it. Rings, buffers and the other queue are untouched, so the
+ * queue is back after two admin commands. Called under rtnl with the
+ * interface running.
+ */
+static int minimal_reset_tx_queue(struct minimal_dev *mdev)
 {
-    netif_start_queue(ndev);
+    struct net_device *ndev = mdev->netdev;
+    u32 size = mdev->tx_ring_size;
+    int ret;
+
+    netif_tx_disable(ndev);
+    napi_disable(&mdev->tx_napi);
+
+    ret = minimal_aq_queue_op(mdev, AQ_OPC_STOP_QUEUE, AQ_QTYPE_TX);
+    if (ret)
+        goto out;
+
+    /* Frames are copied at xmit time: the ones not yet sent are lost */
+    ndev->stats.tx_dropped += (mdev->tx_tail + size - mdev->tx_clean) % size;
+    mdev->tx_tail = 0;
+    mdev->tx_clean = 0;
+    mdev->tx_phase = CQE_PHASE;
+    memset(mdev->tx_cq, 0, sizeof(struct cq_entry) * size);
+    if (mdev->event) {
+        mdev->event->tx_tail = 0;
+        mdev->event->tx_used_event = 0;
+        mdev->event->tx_avail_event = 0;
+    }
+
+    ret = minimal_aq_queue_op(mdev, AQ_OPC_RESET_QUEUE, AQ_QTYPE_TX);
+    mdev->tx_last_head = 0;
+    mdev->tx_last_tail = 0;
+out:
+    napi_enable(&mdev->tx_napi);
+    writel(BIT(mdev->tx_vector), mdev->bar0 + REG_IRQ_MASK_CLR);
+    netif_wake_queue(ndev);
+    return ret;
+}
+
+static int minimal_reset_rx_queue(struct minimal_dev *mdev)
+{
+    u32 i;
+    int ret;
+
+    napi_disable(&mdev->rx_napi);
+
+    ret = minimal_aq_queue_op(mdev, AQ_OPC_STOP_QUEUE, AQ_QTYPE_RX);
+    if (ret)
+        goto out;
+
+    /* Completions not yet handed up are dropped with the ring contents */
+    mdev->rx_next = 0;
+    mdev->rx_phase = CQE_PHASE;
+    memset(mdev->rx_cq, 0, sizeof(struct cq_entry) * mdev->rx_cq_size);
+    if (mdev->event) {
+        mdev->event->rx_tail = 0;
+        mdev->event->rx_used_event = 0;
+        mdev->event->rx_avail_event = 0;
+    }
+
+    /* Striding buffers may be part used: give them back whole */
+    for (i = 0; mdev->rx_strides && i < mdev->rx_ring_size; i++)
+        dma_sync_single_for_device(&mdev->pdev->dev, mdev->rx_pages_dma[i],
+                                   PAGE_SIZE << mdev->rx_page_order,
+                                   DMA_FROM_DEVICE);
+
+    ret = minimal_aq_queue_op(mdev, AQ_OPC_RESET_QUEUE, AQ_QTYPE_RX);
+    if (ret)
+        goto out;
+
+    /* Repost every slot from 0; header split slots get pages as needed */
+    mdev->rx_tail = 0;
+    mdev->rx_refill = mdev->rx_ring_size - 1;
+    minimal_rx_refill(mdev, true);
+    mdev->rx_last_ready = false;
+    mdev->rx_starved = 0;
+out:
+    napi_enable(&mdev->rx_napi);
+    writel(BIT(mdev->rx_vector), mdev->bar0 + REG_IRQ_MASK_CLR);
+    return ret;
+}
+
+/*
+ * Reset one queue in place. If the NIC doesn't even answer the admin
+ * queue, fall back to a function-level reset; reset_prepare() and
+ * reset_done() carry the netdev across it.
+ */
+static int minimal_recover_queue(struct minimal_dev *mdev, u16 qtype)
+{
+    struct net_device *ndev = mdev->netdev;
+    int ret = 0;
+
+    rtnl_lock();
+    if (netif_running(ndev) && netif_device_present(ndev))
+        ret = qtype == AQ_QTYPE_TX ? minimal_reset_tx_queue(mdev) :
+                                     minimal_reset_rx_queue(mdev);
+    rtnl_unlock();
+
+    if (ret) {
+        netdev_err(ndev, "queue reset failed: %d, resetting the function\n",
+                   ret);
+        /* try: remove() holds the device lock while it flushes this work */
+        pci_try_reset_function(mdev->pdev);
+    }
+    return ret;
+}
+
+/*
+ * A queue stopped moving. Through devlink health the event is counted,
+ * the ring is dumped for "devlink health dump show", and the reporter's
+ * recover op resets the queue unless auto-recovery was turned off.
+ */
+static void minimal_queue_stalled(struct minimal_dev *mdev, u16 qtype,
+                                  const char *msg)
+{
+    if (mdev->reporter[qtype])
+        devlink_health_report(mdev->reporter[qtype], msg, NULL);
+    else
+        minimal_recover_queue(mdev, qtype);
+}
+
+static void minimal_reset_work(struct work_struct *work)
+{
+    struct minimal_dev *mdev = container_of(work, struct minimal_dev,
+                                            reset_work);
+
+    if (test_and_clear_bit(AQ_QTYPE_TX, &mdev->reset_pending))
+        minimal_queue_stalled(mdev, AQ_QTYPE_TX, "TX timeout");
+}
+
+static void minimal_schedule_reset(struct minimal_dev *mdev, u16 qtype)
+{
+    set_bit(qtype, &mdev->reset_pending);
+    schedule_work(&mdev->reset_work);
+}
+
+/* The stack saw no TX completion for watchdog_timeo */
+static void minimal_tx_timeout(struct net_device *ndev, unsigned int txqueue)
+{
+    struct minimal_dev *mdev = netdev_priv(ndev);
+
+    netdev_warn(ndev, "TX timeout: tail %u clean %u NIC head %u\n",
+                mdev->tx_tail, mdev->tx_clean,
+                readl(mdev->bar0 + QREG(0, QREG_TX_HEAD)));
+    minimal_schedule_reset(mdev, AQ_QTYPE_TX);
+}
+
+/*
+ * Stall check, once per HEALTH_INTERVAL while the interface is up. A
+ * queue is stalled when it had work outstanding at the previous check
+ * and has not moved since:
+ *  - TX: the NIC head sat still with descriptors posted past it
+ *  - RX: a completion waited at rx_next and NAPI never took it (lost
+ *    interrupt), or the NIC had no buffer while the driver still owed
+ *    it some, i.e. refill is failing and the ring is starved
+ */
+static void minimal_health_work(struct work_struct *work)
+{
+    struct minimal_dev *mdev = container_of(to_delayed_work(work),
+                                            struct minimal_dev, health_work);
+    struct net_device *ndev = mdev->netdev;
+    const char *rx_msg = NULL;
+    bool tx_stall, ready;
+    u32 head;
+
+    rtnl_lock();
+    if (!netif_running(ndev) || !netif_device_present(ndev)) {
+        rtnl_unlock();
+        return;
+    }
+
+    head = readl(mdev->bar0 + QREG(0, QREG_TX_HEAD));
+    tx_stall = mdev->tx_last_head != mdev->tx_last_tail &&
+               head == mdev->tx_last_head;
+    mdev->tx_last_head = head;
+    mdev->tx_last_tail = mdev->tx_tail;
+
+    ready = minimal_cqe_ready(mdev->rx_cq, mdev->rx_next, mdev->rx_phase);
+    if (ready && mdev->rx_last_ready && mdev->rx_next == mdev->rx_last_next)
+        rx_msg = "RX completions not consumed";
+    mdev->rx_last_ready = ready;
+    mdev->rx_last_next = mdev->rx_next;
+
+    if (mdev->rx_refill &&
+        readl(mdev->bar0 + QREG(0, QREG_RX_HEAD)) ==
+        readl(mdev->bar0 + QREG(0, QREG_RX_TAIL)))
+        mdev->rx_starved++;
+    else
+        mdev->rx_starved = 0;
+    if (mdev->rx_starved >= RX_STARVE_CHECKS)
+        rx_msg = "RX ring starved";
+
+    rtnl_unlock();
+
+    if (tx_stall)
+        minimal_queue_stalled(mdev, AQ_QTYPE_TX, "TX head not advancing");
+    if (rx_msg)
+        minimal_queue_stalled(mdev, AQ_QTYPE_RX, rx_msg);
+
+    if (netif_running(ndev))
+        schedule_delayed_work(&mdev->health_work, HEALTH_INTERVAL);
+}
+
+/* Indices as the driver and the NIC see them, NIC side read from BAR0 */
+static void minimal_tx_diag(struct minimal_dev *mdev, struct devlink_fmsg *fmsg)
+{
+    devlink_fmsg_u32_pair_put(fmsg, "ring_size", mdev->tx_ring_size);
+    devlink_fmsg_u32_pair_put(fmsg, "tail", mdev->tx_tail);
+    devlink_fmsg_u32_pair_put(fmsg, "clean", mdev->tx_clean);
+    devlink_fmsg_bool_pair_put(fmsg, "phase", mdev->tx_phase);
+    devlink_fmsg_bool_pair_put(fmsg, "llq", !!mdev->llq);
+    devlink_fmsg_bool_pair_put(fmsg, "queue_stopped",
+                               netif_queue_stopped(mdev->netdev));
+    devlink_fmsg_u32_pair_put(fmsg, "nic_head",
+                              readl(mdev->bar0 + QREG(0, QREG_TX_HEAD)));
+    devlink_fmsg_u32_pair_put(fmsg, "nic_tail",
+                              readl(mdev->bar0 + QREG(0, QREG_TX_TAIL)));
+    if (mdev->event) {
+        devlink_fmsg_u32_pair_put(fmsg, "used_event",
+                                  READ_ONCE(mdev->event->tx_used_event));
+        devlink_fmsg_u32_pair_put(fmsg, "avail_event",
+                                  READ_ONCE(mdev->event->tx_avail_event));
+    }
+}
+
+static void minimal_rx_diag(struct minimal_dev *mdev, struct devlink_fmsg *fmsg)
+{
+    devlink_fmsg_u32_pair_put(fmsg, "ring_size", mdev->rx_ring_size);
+    devlink_fmsg_u32_pair_put(fmsg, "cq_size", mdev->rx_cq_size);
+    devlink_fmsg_u32_pair_put(fmsg, "tail", mdev->rx_tail);
+    devlink_fmsg_u32_pair_put(fmsg, "next", mdev->rx_next);
+    devlink_fmsg_bool_pair_put(fmsg, "phase", mdev->rx_phase);
+    devlink_fmsg_u32_pair_put(fmsg, "refill", mdev->rx_refill);
+    devlink_fmsg_u32_pair_put(fmsg, "nic_head",
+                              readl(mdev->bar0 + QREG(0, QREG_RX_HEAD)));
+    devlink_fmsg_u32_pair_put(fmsg, "nic_tail",
+                              readl(mdev->bar0 + QREG(0, QREG_RX_TAIL)));
+    if (mdev->event) {
+        devlink_fmsg_u32_pair_put(fmsg, "used_event",
+                                  READ_ONCE(mdev->event->rx_used_event));
+        devlink_fmsg_u32_pair_put(fmsg, "avail_event",
+                                  READ_ONCE(mdev->event->rx_avail_event));
+    }
+}
+
+/* rtnl keeps the rings from being rebuilt under the dump */
+static int minimal_tx_reporter_diagnose(struct devlink_health_reporter *reporter,
+                                        struct devlink_fmsg *fmsg,
+                                        struct netlink_ext_ack *extack)
+{
+    struct minimal_dev *mdev = devlink_health_reporter_priv(reporter);
+
+    rtnl_lock();
+    minimal_tx_diag(mdev, fmsg);
+    rtnl_unlock();
     return 0;
 }
 
-static int minimal_stop(struct net_device *ndev)
+static int minimal_tx_reporter_dump(struct devlink_health_reporter *reporter,
+                                    struct devlink_fmsg *fmsg, void *priv_ctx,
+                                    struct netlink_ext_ack *extack)
 {
-    netif_stop_queue(ndev);
+    struct minimal_dev *mdev = devlink_health_reporter_priv(reporter);
+
+    rtnl_lock();
+    minimal_tx_diag(mdev, fmsg);
+    if (mdev->tx_ring) {
+        devlink_fmsg_binary_pair_put(fmsg, "ring", mdev->tx_ring,
+                                     sizeof(struct tx_desc) *
+                                     mdev->tx_ring_size);
+        devlink_fmsg_binary_pair_put(fmsg, "cq", mdev->tx_cq,
+                                     sizeof(struct cq_entry) *
+                                     mdev->tx_ring_size);
+    }
+    rtnl_unlock();
     return 0;
 }
 
-static netdev_tx_t minimal_start_xmit(struct sk_buff *skb,
-                                      struct net_device *ndev)
+static int minimal_tx_reporter_recover(struct devlink_health_reporter *reporter,
+                                       void *priv_ctx,
+                                       struct netlink_ext_ack *extack)
 {
-    /* Later you will DMA this into QEMU */
-    dev_kfree_skb(skb);
-    return NETDEV_TX_OK;
+    return minimal_recover_queue(devlink_health_reporter_priv(reporter),
+                                 AQ_QTYPE_TX);
 }
 
-static const struct net_device_ops minimal_netdev_ops = {
-    .ndo_open       = minimal_open,
-    .ndo_stop       = minimal_stop,
-    .ndo_start_xmit = minimal_start_xmit,
+static int minimal_rx_reporter_diagnose(struct devlink_health_reporter *reporter,
+                                        struct devlink_fmsg *fmsg,
+                                        struct netlink_ext_ack *extack)
+{
+    struct minimal_dev *mdev = devlink_health_reporter_priv(reporter);
+
+    rtnl_lock();
+    minimal_rx_diag(mdev, fmsg);
+    rtnl_unlock();
+    return 0;
+}
+
+static int minimal_rx_reporter_dump(struct devlink_health_reporter *reporter,
+                                    struct devlink_fmsg *fmsg, void *priv_ctx,
+                                    struct netlink_ext_ack *extack)
+{
+    struct minimal_dev *mdev = devlink_health_reporter_priv(reporter);
+
+    rtnl_lock();
+    minimal_rx_diag(mdev, fmsg);
+    if (mdev->rx_ring) {
+        devlink_fmsg_binary_pair_put(fmsg, "ring", mdev->rx_ring,
+                                     sizeof(struct rx_desc) *
+                                     mdev->rx_ring_size);
+        devlink_fmsg_binary_pair_put(fmsg, "cq", mdev->rx_cq,
+                                     sizeof(struct cq_entry) *
+                                     mdev->rx_cq_size);
+    }
+    rtnl_unlock();
+    return 0;
+}
+
+static int minimal_rx_reporter_recover(struct devlink_health_reporter *reporter,
+                                       void *priv_ctx,
+                                       struct netlink_ext_ack *extack)
+{
+    return minimal_recover_queue(devlink_health_reporter_priv(reporter),
+                                 AQ_QTYPE_RX);
+}
+
+static const struct devlink_health_reporter_ops minimal_rx_reporter_ops = {
+    .name     = "rx",
+    .recover  = minimal_rx_reporter_recover,
+    .dump     = minimal_rx_reporter_dump,
+    .diagnose = minimal_rx_reporter_diagnose,
 };
 
-static irqreturn_t minimal_irq_handler(int irq, void *dev_id)
+static const struct devlink_health_reporter_ops minimal_tx_reporter_ops = {
+    .name     = "tx",
+    .recover  = minimal_tx_reporter_recover,
+    .dump     = minimal_tx_reporter_dump,
+    .diagnose = minimal_tx_reporter_diagnose,
+};
+
+static const struct devlink_ops minimal_devlink_ops = {
+};
+
+/* Optional: without devlink, stalls are still recovered, just not reported */
+static void minimal_devlink_init(struct minimal_dev *mdev)
 {
-    struct minimal_dev *mdev = dev_id;
+    static const struct devlink_health_reporter_ops *ops[] = {
+        [AQ_QTYPE_RX] = &minimal_rx_reporter_ops,
+        [AQ_QTYPE_TX] = &minimal_tx_reporter_ops,
+    };
+    struct devlink *devlink;
     int i;
 
-    /*FIXME*/
-    for (i = 0; i < RX_RING_SIZE; i++) {
-        if (mdev->rx_ring[i].flags & RX_DONE) {
-            pr_info("minimal_nic: RX packet len=%u\n",
-                    mdev->rx_ring[i].len);
+    devlink = devlink_alloc(&minimal_devlink_ops, 0, &mdev->pdev->dev);
+    if (!devlink)
+        return;
 
-            /* mark buffer free again */
-            mdev->rx_ring[i].flags = 0;
+    for (i = 0; i < ARRAY_SIZE(ops); i++) {
+        mdev->reporter[i] = devlink_health_reporter_create(devlink, ops[i],
+                                                           HEALTH_GRACE_MS,
+                                                           mdev);
+        if (IS_ERR(mdev->reporter[i])) {
+            netdev_warn(mdev->netdev, "no %s health reporter: %ld\n",
+                        ops[i]->name, PTR_ERR(mdev->reporter[i]));
+            mdev->reporter[i] = NULL;
         }
     }
-    return IRQ_HANDLED;
+
+    devlink_register(devlink);
+    mdev->devlink = devlink;
+}
+
+static void minimal_devlink_fini(struct minimal_dev *mdev)
+{
+    int i;
+
+    if (!mdev->devlink)
+        return;
+
+    devlink_unregister(mdev->devlink);
+    for (i = 0; i < ARRAY_SIZE(mdev->reporter); i++) {
+        if (mdev->reporter[i])
+            devlink_health_reporter_destroy(mdev->reporter[i]);
+        mdev->reporter[i] = NULL;
+    }
+    devlink_free(mdev->devlink);
+    mdev->devlink = NULL;
+}
+
+static void minimal_get_ringparam(struct net_device *ndev,
+                                  struct ethtool_ringparam *ring,
+                                  struct kernel_ethtool_ringparam *kring,
+                                  struct netlink_ext_ack *extack)
+{
+    struct minimal_dev *mdev = netdev_priv(ndev);
+
+    ring->rx_max_pending = RX_RING_MAX;
+    ring->tx_max_pending = TX_RING_MAX;
+    ring->rx_pending = mdev->rx_ring_size;
+    ring->tx_pending = mdev->tx_ring_size;
+}
+
+/* ethtool -G: sizes are rounded up to a power of 2 */
+static int minimal_set_ringparam(struct net_device *ndev,
+                                 struct ethtool_ringparam *ring,
+                                 struct kernel_ethtool_ringparam *kring,
+                                 struct netlink_ext_ack *extack)
+{
+    struct minimal_dev *mdev = netdev_priv(ndev);
+    u32 rx, tx;
+
+    if (ring->rx_mini_pending || ring->rx_jumbo_pending)
+        return -EINVAL;
+
+    rx = roundup_pow_of_two(max_t(u32, ring->rx_pending, RING_MIN));
+    tx = roundup_pow_of_two(max_t(u32, ring->tx_pending, RING_MIN));
+    if (rx == mdev->rx_ring_size && tx == mdev->tx_ring_size)
+        return 0;
+
+    return minimal_reconfigure(mdev, rx, tx, ndev->mtu);
+}
+
+/*
+ * Benchmarking without a backend: the NIC generates RX traffic itself,
+ * shaped by the gen_* module parameters at the time the flag is set.
+ */
+static const char minimal_priv_flags[][ETH_GSTRING_LEN] = {
+    "traffic-gen",
+};
+
+static int minimal_get_sset_count(struct net_device *ndev, int sset)
+{
+    if (sset == ETH_SS_PRIV_FLAGS)
+        return ARRAY_SIZE(minimal_priv_flags);
+    return -EOPNOTSUPP;
+}
+
+static void minimal_get_strings(struct net_device *ndev, u32 sset, u8 *data)
+{
+    if (sset == ETH_SS_PRIV_FLAGS)
+        memcpy(data, minimal_priv_flags, sizeof(minimal_priv_flags));
+}
+
+static u32 minimal_get_priv_flags(struct net_device *ndev)
+{
+    struct minimal_dev *mdev = netdev_priv(ndev);
+
+    return mdev->lb_ctrl & LB_CTRL_GEN ? PRIV_FLAG_TRAFFIC_GEN : 0;
+}
+
+static int minimal_set_priv_flags(struct net_device *ndev, u32 flags)
+{
+    struct minimal_dev *mdev = netdev_priv(ndev);
+
+    if (flags & PRIV_FLAG_TRAFFIC_GEN) {
+        writel(gen_rate, mdev->bar0 + REG_GEN_RATE);
+        writel(gen_size_min, mdev->bar0 + REG_GEN_SIZE_MIN);
+        writel(gen_size_max, mdev->bar0 + REG_GEN_SIZE_MAX);
+        writel(gen_flows, mdev->bar0 + REG_GEN_FLOWS);
+        mdev->lb_ctrl |= LB_CTRL_GEN;
+    } else {
+        mdev->lb_ctrl &= ~LB_CTRL_GEN;
+    }
+    writel(mdev->lb_ctrl, mdev->bar0 + REG_LB_CTRL);
+
+    return 0;
+}
+
+static const struct ethtool_ops minimal_ethtool_ops = {
+    .get_link               = ethtool_op_get_link,
+    .get_ringparam          = minimal_get_ringparam,
+    .set_ringparam          = minimal_set_ringparam,
+    .get_sset_count         = minimal_get_sset_count,
+    .get_strings            = minimal_get_strings,
+    .get_priv_flags         = minimal_get_priv_flags,
+    .set_priv_flags         = minimal_set_priv_flags,
+};
+
+static const struct net_device_ops minimal_netdev_ops = {
+    .ndo_open               = minimal_open,
+    .ndo_stop               = minimal_stop,
+    .ndo_start_xmit         = minimal_start_xmit,
+    .ndo_set_rx_mode        = minimal_set_rx_mode,
+    .ndo_set_mac_address    = minimal_set_mac_address,
+    .ndo_vlan_rx_add_vid    = minimal_vlan_rx_add_vid,
+    .ndo_vlan_rx_kill_vid   = minimal_vlan_rx_kill_vid,
+    .ndo_set_features       = minimal_set_features,
+    .ndo_change_mtu         = minimal_change_mtu,
+    .ndo_get_stats64        = minimal_get_stats64,
+    .ndo_tx_timeout         = minimal_tx_timeout,
+};
+
+/*
+ * The NIC reports a permanent address; a VF's is derived from the PF's
+ * so the internal switch can tell the functions apart. Older devices
+ * return 0 here and get a random one.
+ */
+static void minimal_read_mac(struct minimal_dev *mdev)
+{
+    u32 lo = readl(mdev->bar0 + REG_MAC_LO);
+    u32 hi = readl(mdev->bar0 + REG_MAC_HI);
+    u8 addr[ETH_ALEN];
+
+    addr[0] = lo;
+    addr[1] = lo >> 8;
+    addr[2] = lo >> 16;
+    addr[3] = lo >> 24;
+    addr[4] = hi;
+    addr[5] = hi >> 8;
+
+    if ((hi & MAC_VALID) && is_valid_ether_addr(addr))
+        eth_hw_addr_set(mdev->netdev, addr);
+    else
+        eth_hw_addr_random(mdev->netdev);
 }
 
 static int minimal_probe(struct pci_dev *pdev,
@@ -95,83 +2123,113 @@ static int minimal_probe(struct pci_dev *pdev,
 {
     struct minimal_dev *mdev;
     struct net_device *ndev;
+    struct irq_affinity affd = {};
+    struct aq_cmd cmd;
     int ret, nvec, i;
 
     pr_info(DRV_NAME ": probe\n");
 
-    ndev = alloc_etherdev(0);
+    /* minimal_dev lives in the netdev private area */
+    ndev = alloc_etherdev(sizeof(*mdev));
     if (!ndev)
         return -ENOMEM;
 
-    mdev = devm_kzalloc(&pdev->dev, sizeof(*mdev), GFP_KERNEL);
-    if (!mdev)
-        return -ENOMEM;
-
+    mdev = netdev_priv(ndev);
     mdev->pdev = pdev;
     pci_set_drvdata(pdev, mdev);
 
     mdev->netdev = ndev;
+    INIT_WORK(&mdev->reset_work, minimal_reset_work);
+    INIT_DELAYED_WORK(&mdev->health_work, minimal_health_work);
     ndev->netdev_ops = &minimal_netdev_ops;
+    ndev->ethtool_ops = &minimal_ethtool_ops;
     ndev->min_mtu = 68;
-    ndev->max_mtu = 1500;
-
-    eth_hw_addr_random(ndev);
+    ndev->priv_flags |= IFF_UNICAST_FLT | IFF_LIVE_ADDR_CHANGE;
+    ndev->hw_features |= NETIF_F_HW_VLAN_CTAG_FILTER |
+                         NETIF_F_HW_VLAN_CTAG_RX |
+                         NETIF_F_HW_VLAN_CTAG_TX;
+    ndev->features |= ndev->hw_features;
+    /* Off by default: ethtool -K <dev> loopback on */
+    ndev->hw_features |= NETIF_F_LOOPBACK;
 
     SET_NETDEV_DEV(ndev, &pdev->dev);
 
-    ret = register_netdev(ndev);
+    /* Enable PCI device and bus-mastering */
+    pr_info(DRV_NAME ": PCI enable device\n");
+    ret = pci_enable_device(pdev);
     if (ret) {
         free_netdev(ndev);
         return ret;
     }
 
-    pr_info(DRV_NAME ": registered netdev %s\n", ndev->name);
+    pci_set_master(pdev);
 
+    /* Rings can live anywhere in guest memory; 32-bit only as a fallback */
+    ret = dma_set_mask_and_coherent(&pdev->dev, DMA_BIT_MASK(64));
+    if (ret)
+        ret = dma_set_mask_and_coherent(&pdev->dev, DMA_BIT_MASK(32));
+    if (ret) {
+        dev_err(&pdev->dev, "no usable DMA mask\n");
+        goto err_disable;
+    }
 
+    /* An mmio-only device has no data path for a netdev to drive */
+    if (!pdev->msi_cap && !pdev->msix_cap) {
+        dev_err(&pdev->dev, "no MSI or MSI-X, device is mmio-only\n");
+        ret = -ENODEV;
+        goto err_disable;
+    }
 
-    /* Enable PCI device and bus-mastering */
-    pr_info(DRV_NAME ": PCI enable device\n");
-    ret = pci_enable_device(pdev);
-    if (ret) {
-        unregister_netdev(ndev);
-        free_netdev(ndev);
-        return ret;
+    /*
+     * The device exposes either MSI-X or MSI, with a vector count set on
+     * the QEMU command line; take whichever it offers and as many vectors
+     * as the PCI core grants. PCI_IRQ_AFFINITY spreads them over the
+     * CPUs as managed interrupts, so each vector's completions are
+     * handled on the CPU it is bound to.
+     */
+    mdev->nvec_irq = pci_alloc_irq_vectors_affinity(pdev,
+                                           1,              // min vectors
+                                           MAX_VECTORS,    // max vectors
+                                           PCI_IRQ_MSIX | PCI_IRQ_MSI |
+                                           PCI_IRQ_AFFINITY,
+                                           &affd);
+    if (mdev->nvec_irq < 0) {
+        ret = mdev->nvec_irq;
+        goto err_disable;
     }
 
-    pci_set_master(pdev);
+    /* RX and TX get their own vectors when there are two to go round */
+    mdev->rx_vector = 0;
+    mdev->tx_vector = mdev->nvec_irq > 1 ? 1 : 0;
 
-#ifdef MSIX_ENABLE
-    /* Request MSI-X vectors explicitly */
-    mdev->nvec_irq = pci_alloc_irq_vectors(pdev,
-                                           1,    // min vectors
-                                           MAX_MSIX_VECTORS,    // max vectors
-                                           PCI_IRQ_MSIX);
-#else
-    /* Fallback to MSI with per-vector masking */
-    mdev->nvec_irq = pci_alloc_irq_vectors(pdev,
-                                1,
-                                MAX_MSI_VECTORS,
-                                PCI_IRQ_MSI);
-#endif
-
-    if (mdev->nvec_irq < 0)
-        return mdev->nvec_irq;
+    /* NAPI must exist before its vector can fire; it starts disabled */
+    netif_napi_add(ndev, &mdev->rx_napi, minimal_rx_poll);
+    netif_napi_add_tx(ndev, &mdev->tx_napi, minimal_tx_poll);
 
+    /*
+     * Not devm: the handler's cookie lives in the netdev, which remove()
+     * frees before devres would release the IRQs.
+     */
     for (i = 0; i < mdev->nvec_irq; i++) {
         int irq = pci_irq_vector(pdev, i);
 
-        ret = devm_request_irq(&pdev->dev,
-                               irq,
-                               minimal_irq_handler,
-                               0,
-                               DRV_NAME,
-                               mdev);
+        ret = request_irq(irq,
+                          minimal_vector_handler(mdev, i),
+                          0,
+                          mdev->vecs[i].name,
+                          &mdev->vecs[i]);
         if (ret) {
             dev_err(&pdev->dev, "IRQ %d request failed\n", i);
-            goto err_irq;
+            while (--i >= 0)
+                free_irq(pci_irq_vector(pdev, i), &mdev->vecs[i]);
+            goto err_vectors;
         }
     }
 
+    /* Lets busy polling and netlink find the IRQ behind each NAPI */
+    netif_napi_set_irq(&mdev->rx_napi, pci_irq_vector(pdev, mdev->rx_vector));
+    netif_napi_set_irq(&mdev->tx_napi, pci_irq_vector(pdev, mdev->tx_vector));
+
     /* Map BAR0 (device MMIO) */
     ret = pci_request_region(pdev, 0, DRV_NAME);
     if (ret)
@@ -183,100 +2241,368 @@ static int minimal_probe(struct pci_dev *pdev,
         goto err_region0;
     }
 
-    /* Map BAR1 (MSI-X table/PBA) */
-    ret = pci_request_region(pdev, 1, DRV_NAME);
-    if (ret)
+    /* Queues start masked, minimal_open() enables them */
+    writel(BIT(mdev->rx_vector) | BIT(mdev->tx_vector),
+           mdev->bar0 + REG_IRQ_MASK_SET);
+
+    /* Each stage of the model is a property; the netdev needs both rings */
+    mdev->caps = readl(mdev->bar0 + REG_DEV_CAPS);
+    if ((mdev->caps & (DEV_CAP_RX | DEV_CAP_TX)) != (DEV_CAP_RX | DEV_CAP_TX)) {
+        dev_err(&pdev->dev, "device caps %#x lack RX or TX\n", mdev->caps);
+        ret = -ENODEV;
         goto err_region0;
+    }
+    if (!(mdev->caps & DEV_CAP_VLAN)) {
+        ndev->hw_features &= ~(NETIF_F_HW_VLAN_CTAG_FILTER |
+                               NETIF_F_HW_VLAN_CTAG_RX |
+                               NETIF_F_HW_VLAN_CTAG_TX);
+        ndev->features &= ~(NETIF_F_HW_VLAN_CTAG_FILTER |
+                            NETIF_F_HW_VLAN_CTAG_RX |
+                            NETIF_F_HW_VLAN_CTAG_TX);
+    }
+
+    minimal_read_mac(mdev);
+
+    /* Map BAR2 (MSI-X table/PBA), only present in MSI-X mode */
+    if (pdev->msix_enabled) {
+        ret = pci_request_region(pdev, MSIX_BAR, DRV_NAME);
+        if (ret)
+            goto err_region0;
 
-    mdev->bar1 = pci_iomap(pdev, 1, 0);
-    if (!mdev->bar1) {
+        mdev->msix_bar = pci_iomap(pdev, MSIX_BAR, 0);
+        if (!mdev->msix_bar) {
+            ret = -ENOMEM;
+            goto err_region1;
+        }
+    }
+
+    /* Notification suppression area, must be in place before the rings */
+    if (event_idx && (mdev->caps & DEV_CAP_EVENT_IDX)) {
+        mdev->event = dma_alloc_coherent(&pdev->dev, sizeof(*mdev->event),
+                                         &mdev->event_dma, GFP_KERNEL);
+        if (mdev->event)
+            writeq(mdev->event_dma, mdev->bar0 + REG_EVENT_BASE);
+    }
+
+    /* Admin queue: the only setup still done with plain register writes */
+    spin_lock_init(&mdev->aq_lock);
+    mdev->aq = dma_alloc_coherent(&pdev->dev,
+            sizeof(struct aq_cmd) * AQ_RING_SIZE,
+            &mdev->aq_dma, GFP_KERNEL);
+    mdev->aq_buf = dma_alloc_coherent(&pdev->dev, AQ_BUF_SIZE,
+                                      &mdev->aq_buf_dma, GFP_KERNEL);
+    if (!mdev->aq || !mdev->aq_buf) {
         ret = -ENOMEM;
-        goto err_region1;
+        goto err_aq;
     }
+    writeq(mdev->aq_dma,     mdev->bar0 + REG_AQ_BASE);
+    writel(AQ_RING_SIZE,     mdev->bar0 + REG_AQ_SIZE);
 
-    /* Allocate RX ring
-     * 1. Allocates memory
-     * 2. Makes it visible to the device
-     * Returns the physical DMA address
-     */
+    /* Striding needs whole multi-page buffers, so it excludes header split */
+    mdev->rx_strides = mdev->caps & DEV_CAP_RX_STRIDE ? rx_strides : 0;
+    if (mdev->rx_strides &&
+        (!is_power_of_2(mdev->rx_strides) || mdev->rx_strides > RX_MAX_STRIDES)) {
+        dev_warn(&pdev->dev, "rx_strides=%u invalid, striding off\n",
+                 mdev->rx_strides);
+        mdev->rx_strides = 0;
+    }
+    mdev->hdr_split = hdr_split && (mdev->caps & DEV_CAP_HDR_SPLIT) &&
+                      !mdev->rx_strides;
+    ndev->max_mtu = minimal_max_mtu(mdev);
 
-    mdev->rx_ring = dma_alloc_coherent(&pdev->dev,
-            sizeof(struct rx_desc) * RX_RING_SIZE,
-            &mdev->rx_ring_dma, GFP_KERNEL);
+    mdev->rx_ring_size = RX_RING_DEFAULT;
+    mdev->tx_ring_size = TX_RING_DEFAULT;
+    ret = minimal_alloc_rings(mdev);
+    if (ret)
+        goto err_rings;
+
+    /* LLQ is optional: any failure keeps descriptors in host memory */
+    if (tx_llq && (mdev->caps & DEV_CAP_LLQ) &&
+        !pci_request_region(pdev, LLQ_BAR, DRV_NAME)) {
+        mdev->llq_len = pci_resource_len(pdev, LLQ_BAR);
+        mdev->llq_map = ioremap_wc(pci_resource_start(pdev, LLQ_BAR),
+                                   mdev->llq_len);
+        if (!mdev->llq_map)
+            pci_release_region(pdev, LLQ_BAR);
+    }
+
+    /* Ack what is in use; the device turns the rest off */
+    mdev->features = mdev->caps & (DEV_CAP_RX | DEV_CAP_TX | DEV_CAP_MSI |
+                                   DEV_CAP_MSIX | DEV_CAP_VLAN);
+    if (mdev->event)
+        mdev->features |= DEV_CAP_EVENT_IDX;
+    if (mdev->llq_map)
+        mdev->features |= DEV_CAP_LLQ;
+    if (mdev->rx_strides)
+        mdev->features |= DEV_CAP_RX_STRIDE;
+    if (mdev->hdr_split)
+        mdev->features |= DEV_CAP_HDR_SPLIT;
+    if (cqe_compress)
+        mdev->features |= mdev->caps & DEV_CAP_CQE_COMPRESS;
+    writel(mdev->features, mdev->bar0 + REG_DRV_FEATURES);
 
-    /* Here are 16 empty buffers of 2048 bytes each */
-    for (i = 0; i < RX_RING_SIZE; i++) {
-        mdev->rx_bufs[i] = dma_alloc_coherent(&pdev->dev,
-                RX_BUF_SIZE,
-                &mdev->rx_bufs_dma[i],
-                GFP_KERNEL);
+    ret = minimal_create_queues(mdev);
+    if (ret)
+        goto err_llq;
 
-        mdev->rx_ring[i].addr = mdev->rx_bufs_dma[i];
-        mdev->rx_ring[i].len = RX_BUF_SIZE;
-        mdev->rx_ring[i].flags = 0;
+    /* Counters are optional: without the page, stats are software only */
+    mdev->stats = dma_alloc_coherent(&pdev->dev, sizeof(*mdev->stats),
+                                     &mdev->stats_dma, GFP_KERNEL);
+    if (mdev->stats) {
+        cmd = (struct aq_cmd) {
+            .opcode = AQ_OPC_SET_STATS,
+            .addr = mdev->stats_dma,
+            .val = stats_interval_ms,
+        };
+        if (minimal_aq_exec(mdev, &cmd, NULL, NULL, 0)) {
+            dma_free_coherent(&pdev->dev, sizeof(*mdev->stats),
+                              mdev->stats, mdev->stats_dma);
+            mdev->stats = NULL;
+        }
     }
 
-    /* Program device */
-    writel(mdev->rx_ring_dma, mdev->bar0 + REG_RX_RING_BASE);
-    writel(RX_RING_SIZE,     mdev->bar0 + REG_RX_RING_SIZE);
-    writel(RX_RING_SIZE-1,   mdev->bar0 + REG_RX_TAIL);
+    pr_info(DRV_NAME ": BAR0=%p BAR2=%p IRQ Vector Number=%d\n",
+            mdev->bar0, mdev->msix_bar, mdev->nvec_irq);
+
+    /* Register last: ndo callbacks touch BAR0 as soon as the netdev is visible */
+    ret = register_netdev(ndev);
+    if (ret)
+        goto err_stats;
+
+    minimal_devlink_init(mdev);
 
-    pr_info(DRV_NAME ": BAR0=%p BAR1=%p IRQ Vector Number=%d\n",
-            mdev->bar0, mdev->bar1, mdev->nvec_irq);
+    if (pdev->is_virtfn)
+        pr_info(DRV_NAME ": registered netdev %s for VF %d\n", ndev->name,
+                pci_iov_vf_id(pdev));
+    else
+        pr_info(DRV_NAME ": registered netdev %s\n", ndev->name);
 
     return 0;
 
+err_stats:
+    /* The NIC keeps DMAing snapshots until the page is unregistered */
+    if (mdev->stats) {
+        cmd = (struct aq_cmd) { .opcode = AQ_OPC_SET_STATS };
+        minimal_aq_exec(mdev, &cmd, NULL, NULL, 0);
+        dma_free_coherent(&pdev->dev, sizeof(*mdev->stats),
+                          mdev->stats, mdev->stats_dma);
+    }
+err_llq:
+    minimal_destroy_queues(mdev);
+    if (mdev->llq_map) {
+        writel(0, mdev->bar0 + REG_TX_CTRL);
+        iounmap(mdev->llq_map);
+        pci_release_region(pdev, LLQ_BAR);
+    }
+err_rings:
+    minimal_free_rings(mdev);
+err_aq:
+    /* Either buffer may be missing if the other failed to allocate */
+    writel(0, mdev->bar0 + REG_AQ_SIZE);
+    writeq(0, mdev->bar0 + REG_AQ_BASE);
+    if (mdev->aq_buf)
+        dma_free_coherent(&pdev->dev, AQ_BUF_SIZE, mdev->aq_buf,
+                          mdev->aq_buf_dma);
+    if (mdev->aq)
+        dma_free_coherent(&pdev->dev, sizeof(struct aq_cmd) * AQ_RING_SIZE,
+                          mdev->aq, mdev->aq_dma);
+err_event:
+    if (mdev->event) {
+        writeq(0, mdev->bar0 + REG_EVENT_BASE);
+        dma_free_coherent(&pdev->dev, sizeof(*mdev->event),
+                          mdev->event, mdev->event_dma);
+    }
 err_region1:
-    pci_release_region(pdev, 1);
+    if (mdev->msix_bar)
+        pci_iounmap(pdev, mdev->msix_bar);
+    if (pdev->msix_enabled)
+        pci_release_region(pdev, MSIX_BAR);
 err_region0:
     pci_iounmap(pdev, mdev->bar0);
     pci_release_region(pdev, 0);
 err_irq:
+    for (i = 0; i < mdev->nvec_irq; i++)
+        free_irq(pci_irq_vector(pdev, i), &mdev->vecs[i]);
+err_vectors:
     pci_free_irq_vectors(pdev);
 err_disable:
     pci_disable_device(pdev);
+    free_netdev(ndev);
     return ret;
 }
 
+/*
+ * PF only: echo N > /sys/bus/pci/devices/<pf>/sriov_numvfs. Each VF is
+ * bound to this driver like any other function and gets its own netdev.
+ */
+static int minimal_sriov_configure(struct pci_dev *pdev, int num_vfs)
+{
+    int ret;
+
+    if (!num_vfs) {
+        if (pci_vfs_assigned(pdev)) {
+            dev_warn(&pdev->dev, "VFs are assigned, not disabling SR-IOV\n");
+            return -EPERM;
+        }
+        pci_disable_sriov(pdev);
+        return 0;
+    }
+
+    ret = pci_enable_sriov(pdev, num_vfs);
+    if (ret)
+        return ret;
+
+    return num_vfs;
+}
+
 /* Remove */
 static void minimal_remove(struct pci_dev *pdev)
 {
     struct minimal_dev *mdev = pci_get_drvdata(pdev);
     int i;
 
-    if (mdev->netdev) {
-        unregister_netdev(mdev->netdev);
-        free_netdev(mdev->netdev);
-    }
+    /* VFs share the PF's backend, take them down while it still runs */
+    if (!pdev->is_virtfn && !pci_vfs_assigned(pdev))
+        pci_disable_sriov(pdev);
+
+    unregister_netdev(mdev->netdev);
+    cancel_delayed_work_sync(&mdev->health_work);
+    cancel_work_sync(&mdev->reset_work);
+    minimal_devlink_fini(mdev);
     pr_info(DRV_NAME ": remove\n");
-    for (i = 0; i < RX_RING_SIZE; i++) {
-        if (mdev->rx_bufs[i])
-            dma_free_coherent(&pdev->dev, RX_BUF_SIZE,
-                              mdev->rx_bufs[i],
-                              mdev->rx_bufs_dma[i]);
+
+    /* Stop the NIC touching the rings before they are freed */
+    writel(0, mdev->bar0 + REG_LB_CTRL);
+    minimal_destroy_queues(mdev);
+
+    if (mdev->stats) {
+        struct aq_cmd cmd = { .opcode = AQ_OPC_SET_STATS };
+
+        minimal_aq_exec(mdev, &cmd, NULL, NULL, 0);
+        dma_free_coherent(&pdev->dev, sizeof(*mdev->stats),
+                          mdev->stats, mdev->stats_dma);
     }
+    minimal_free_rings(mdev);
 
-    if (mdev->rx_ring)
-        dma_free_coherent(&pdev->dev,
-                          sizeof(struct rx_desc) * RX_RING_SIZE,
-                          mdev->rx_ring,
-                          mdev->rx_ring_dma);
+    if (mdev->event) {
+        writeq(0, mdev->bar0 + REG_EVENT_BASE);
+        dma_free_coherent(&pdev->dev, sizeof(*mdev->event),
+                          mdev->event, mdev->event_dma);
+    }
 
-    if (mdev->bar1)
-        pci_iounmap(pdev, mdev->bar1);
-    pci_release_region(pdev, 1);
+    if (mdev->llq_map) {
+        writel(0, mdev->bar0 + REG_TX_CTRL);
+        iounmap(mdev->llq_map);
+        pci_release_region(pdev, LLQ_BAR);
+    }
+
+    writel(0, mdev->bar0 + REG_AQ_SIZE);
+    writeq(0, mdev->bar0 + REG_AQ_BASE);
+    dma_free_coherent(&pdev->dev, AQ_BUF_SIZE, mdev->aq_buf,
+                      mdev->aq_buf_dma);
+    dma_free_coherent(&pdev->dev, sizeof(struct aq_cmd) * AQ_RING_SIZE,
+                      mdev->aq, mdev->aq_dma);
+
+    if (mdev->msix_bar)
+        pci_iounmap(pdev, mdev->msix_bar);
+    if (pdev->msix_enabled)
+        pci_release_region(pdev, MSIX_BAR);
 
     if (mdev->bar0)
         pci_iounmap(pdev, mdev->bar0);
     pci_release_region(pdev, 0);
 
+    for (i = 0; i < mdev->nvec_irq; i++)
+        free_irq(pci_irq_vector(pdev, i), &mdev->vecs[i]);
     pci_free_irq_vectors(pdev);
     pci_disable_device(pdev);
+
+    /* mdev is part of the netdev, free it last */
+    free_netdev(mdev->netdev);
+}
+
+/*
+ * Function-level reset without reloading the driver, from the reset work
+ * or from /sys/bus/pci/devices/<dev>/reset. The NIC comes back with
+ * nothing programmed, so everything probe set up is replayed on the
+ * existing allocations, and the rings are rebuilt from scratch.
+ */
+static void minimal_reset_prepare(struct pci_dev *pdev)
+{
+    struct minimal_dev *mdev = pci_get_drvdata(pdev);
+    struct net_device *ndev = mdev->netdev;
+
+    rtnl_lock();
+    if (netif_running(ndev))
+        minimal_stop(ndev);
+    netif_device_detach(ndev);
+    rtnl_unlock();
+}
+
+static void minimal_reset_done(struct pci_dev *pdev)
+{
+    struct minimal_dev *mdev = pci_get_drvdata(pdev);
+    struct net_device *ndev = mdev->netdev;
+    struct aq_cmd cmd;
+    int ret;
+
+    rtnl_lock();
+
+    writel(BIT(mdev->rx_vector) | BIT(mdev->tx_vector),
+           mdev->bar0 + REG_IRQ_MASK_SET);
+    if (mdev->event)
+        writeq(mdev->event_dma, mdev->bar0 + REG_EVENT_BASE);
+    mdev->aq_tail = 0;
+    writeq(mdev->aq_dma, mdev->bar0 + REG_AQ_BASE);
+    writel(AQ_RING_SIZE, mdev->bar0 + REG_AQ_SIZE);
+    writel(mdev->features, mdev->bar0 + REG_DRV_FEATURES);
+
+    minimal_free_rings(mdev);
+    ret = minimal_alloc_rings(mdev);
+    if (!ret)
+        ret = minimal_create_queues(mdev);
+    if (ret) {
+        netdev_err(ndev, "rings lost after reset, device detached: %d\n", ret);
+        minimal_free_rings(mdev);
+        goto out;
+    }
+
+    cmd = (struct aq_cmd) { .opcode = AQ_OPC_SET_MTU, .val = ndev->mtu };
+    minimal_aq_exec(mdev, &cmd, NULL, NULL, 0);
+    if (mdev->stats) {
+        cmd = (struct aq_cmd) {
+            .opcode = AQ_OPC_SET_STATS,
+            .addr = mdev->stats_dma,
+            .val = stats_interval_ms,
+        };
+        minimal_aq_exec(mdev, &cmd, NULL, NULL, 0);
+    }
+
+    /* Filters: the shadow hash no longer matches the NIC's empty one */
+    memset(mdev->mc_hash, 0, sizeof(mdev->mc_hash));
+    minimal_aq_set_filter(mdev, AQ_FILTER_VLAN, 0, mdev->vlan_table,
+                          VLAN_TABLE_WORDS);
+    netif_addr_lock_bh(ndev);
+    minimal_set_rx_mode(ndev);
+    netif_addr_unlock_bh(ndev);
+    minimal_set_priv_flags(ndev, minimal_get_priv_flags(ndev));
+
+    netif_device_attach(ndev);
+    if (netif_running(ndev))
+        minimal_open(ndev);
+out:
+    rtnl_unlock();
 }
 
+static const struct pci_error_handlers minimal_err_handlers = {
+    .reset_prepare = minimal_reset_prepare,
+    .reset_done    = minimal_reset_done,
+};
+
 /* PCI ID Table */
 static const struct pci_device_id minimal_pci_ids[] = {
     { PCI_DEVICE(VENDOR_ID, DEVICE_ID) },
+    { PCI_DEVICE(VENDOR_ID, VF_DEVICE_ID) },
     { }
 };
 MODULE_DEVICE_TABLE(pci, minimal_pci_ids);
@@ -287,6 +2613,8 @@ static struct pci_driver minimal_pci_driver = {
     .id_table = minimal_pci_ids,
     .probe    = minimal_probe,
     .remove   = minimal_remove,
+    .sriov_configure = minimal_sriov_configure,
+    .err_handler = &minimal_err_handlers,
 };
 
 module_pci_driver(minimal_pci_driver);
@@ -9,261 +9,2682 @@
  * - MMIO accesses are trapped and handled by callbacks
  * - memory_region_init_io(..., 0x1000) does NOT allocate 4 KB memory
  *   → It only creates a 0x1000 address window the guest can access
- * - The actual storage backing reads/writes is regs[] (64 bytes)
+ * - Control registers are declared in a RegisterAccessInfo table and
+ *   dispatched through reg_map[], one slot per 32-bit word of BAR0
+ * - This is the one configurable model: properties select each stage of
+ *   the walkthrough (mmio-only, MSI or MSI-X, RX, TX, offloads), and the
+ *   resulting DEV_CAP_* bits are negotiated with the driver at probe
  */
 
 #include "qemu/osdep.h"
 #include "hw/pci/pci.h"
 #include "hw/pci/pci_device.h"
+#include "hw/pci/msi.h"
+#include "hw/pci/msix.h"
+#include "hw/pci/pcie.h"
+#include "hw/pci/pcie_sriov.h"
 #include "hw/qdev-properties.h"
 #include "qemu/module.h"
+#include "qemu/host-utils.h"
+#include "qemu/bitops.h"
+#include "qemu/main-loop.h"
+#include "qemu/log.h"
+#include "qemu/atomic.h"
+#include "qemu/timer.h"
 #include "qapi/error.h"
 #include "exec/memory.h" /* MemoryRegion */
 #include "hw/irq.h"
+#include "hw/register.h"
+#include "migration/vmstate.h"
 #include "net/net.h"
+#include "net/eth.h"
+#include "net/checksum.h"
 
 #define TYPE_MINIMAL_PCIE_NIC "minimal-pcie-nic"    // qemu device name
-#define MSI_NUM_VECTORS         4                   // msi max vectors
-#define MSIX_NUM_VECTORS        4                   // msi-x max vectors
+#define TYPE_MINIMAL_PCIE_NIC_VF "minimal-pcie-nic-vf"  // SR-IOV VF, created by the PF
+#define MINIMAL_DEVICE_ID       0x10f1
+#define MINIMAL_VF_DEVICE_ID    0x10f2
+#define MSI_MAX_VECTORS         32                  // msi max vectors
+#define MSIX_MAX_VECTORS        64                  // msi-x max vectors
 #define MSIX_BAR_SIZE           0x1000              // 4KB MSIX Bar size
-#define MSIX_ENABLE                                 // Select MSI or MSI-X
-#define BAR1_MSIX_IDX           1                   // Use BAR 1 for MSI-X
+#define MSIX_PBA_OFFSET         0x800               // PBA after the largest table
+#define BAR2_MSIX_IDX           2                   // Use BAR 2 for MSI-X (BAR0 is 64-bit)
 #define BAR0_IDX                0                   // Use BAR 0 for MMIO
+#define MMIO_BAR_SIZE           0x1000              // 4KB register BAR
+#define QUEUE_MAX               1                   // queue register blocks in BAR0
+#define BAR4_LLQ_IDX            4                   // Use BAR 4 for TX descriptor push
+#define LLQ_BAR_SIZE            0x40000             // 256KB: LLQ for TX rings up to 1024
+#define UC_TABLE_ENTRIES        16                  // perfect-match unicast slots
+#define MC_HASH_WORDS           128                 // 4096-bit multicast hash
+#define VLAN_TABLE_WORDS        128                 // one bit per VLAN ID
+#define TX_MAX_FRAME            9216                // largest frame the TX path stages (jumbo)
+#define CQE_SESSION_MAX         32                  // frames per compressed completion
+#define SRIOV_MAX_VFS           32                  // "sriov-vfs" property limit
+#define ARI_CAP_OFFSET          0x100               // extended capabilities
+#define SRIOV_CAP_OFFSET        0x160
+#define SRIOV_VF_OFFSET         1                   // VF n is at PF devfn + 1 + n
+#define SRIOV_VF_STRIDE         1
+#define ATS_CAP_OFFSET          0x120
+#define IOTLB_ENTRIES           64                  // device IOTLB slots
+#define IOTLB_PAGE_BITS         12                  // slot index granule
+#define GEN_TICK_NS             1000000             // traffic generator period: 1 ms
+#define GEN_BURST_MAX           4096                // frames per generator tick
+#define CAP_MAGIC               0x313050414343494eULL   // "NICCAP01" in the capture file
+#define CAP_PCAPNG_OFFSET       64                  // pcapng SHB + IDB
+#define CAP_DATA_OFFSET         4096                // ring of pcapng EPBs
+#define CAP_SIZE_MIN            (64 * KiB)
 
 OBJECT_DECLARE_SIMPLE_TYPE(MinimalPCIeNICState, MINIMAL_PCIE_NIC)
 
+/*
+ * Completion queue entry. Written sequentially by the device, the phase
+ * bit flips on every pass so the driver never has to clear entries.
+ */
+struct cq_entry {
+    uint16_t id;        /* Submission ring slot this completes */
+    uint16_t len;
+    uint16_t flags;     /* RX_* / TX_* status bits and CQE_PHASE */
+    uint16_t vlan_tci;
+    uint16_t hdr_len;
+    uint16_t stride;    /* First stride used, striding RX only */
+    uint16_t rsvd[2];
+};
+
+#define CQE_PHASE       0x8000
+#define CQE_COMPRESSED  0x4000  /* Title of a compressed block, hdr_len = frames */
+
+/*
+ * A compressed block is a title entry followed by entries each packing
+ * CQE_MINI_PER_ENTRY frame lengths around the flags word. That word holds
+ * the previous pass's phase, so a mini entry never reads as a completion.
+ * Ids and strides of the following frames are implied: consecutive ring
+ * slots, or consecutive strides of the same buffer when striding.
+ */
+#define CQE_MINI_FLAGS      (offsetof(struct cq_entry, flags) / sizeof(uint16_t))
+#define CQE_MINI_PER_ENTRY  (sizeof(struct cq_entry) / sizeof(uint16_t) - 1)
+
+/* Completion queue: same number of entries as its submission ring */
+typedef struct MinimalCQ {
+    uint64_t base;      /* 0: complete in place in the submission ring */
+    uint32_t tail;      /* Next entry the device writes */
+    uint16_t phase;     /* CQE_PHASE value for the current pass */
+} MinimalCQ;
+
+/*
+ * Capture ring file header, in host byte order. A reader copies the
+ * pcapng section and interface blocks once, then follows the ring:
+ * bytes [head - data_size, head) are valid Enhanced Packet Blocks,
+ * laid out back to back at (offset % data_size). A block never wraps;
+ * a block type of 0 means "skip to the start of the ring". head is
+ * stored with release semantics after each block is complete; a reader
+ * that finds head moved more than data_size past a block it has just
+ * copied must discard the copy.
+ */
+struct cap_ring_hdr {
+    uint64_t magic;             /* CAP_MAGIC */
+    uint32_t version;           /* 1 */
+    uint32_t pcapng_len;
+    uint64_t pcapng_off;
+    uint64_t data_off;
+    uint64_t data_size;         /* Power of 2 */
+    uint64_t head;              /* Bytes ever written to the ring */
+};
+
+/* A translation handed out by the vIOMMU through ATS */
+typedef struct MinimalIOTLBEntry {
+    hwaddr iova;                /* Aligned to addr_mask + 1 */
+    hwaddr addr_mask;
+    hwaddr translated;
+    AddressSpace *as;           /* Where translated addresses live */
+    IOMMUAccessFlags perm;      /* IOMMU_NONE: empty slot */
+} MinimalIOTLBEntry;
+
 /* Device state structure */
 typedef struct MinimalPCIeNICState {
     PCIDevice parent_obj;      /* Must be first */
     MemoryRegion mmio;         /* BAR0 Device Registers */
-    MemoryRegion msix_bar;      /* BAR1: MSI-X table + PBA */
-    uint32_t regs[16];         /* Simulated device registers (64 bytes) */
+    MemoryRegion msix_bar;      /* BAR2: MSI-X table + PBA */
+    MemoryRegion llq_bar;      /* BAR4: TX descriptors pushed by the driver */
+    bool llq;                  /* "llq" property: expose BAR4 and DEV_CAP_LLQ */
+    bool msix;                 /* "msix" property: MSI-X, or MSI when off */
+    uint32_t vectors;          /* "vectors" property: MSI/MSI-X vector count */
+    uint16_t sriov_vfs;        /* "sriov-vfs" property: total VFs, 0 = no SR-IOV */
+    bool ats;                  /* "ats" property: expose the ATS capability */
+    bool mmio_only;            /* "mmio-only": BAR0 registers, no IRQs or data path */
+    bool rx;                   /* "rx": RX queue and delivery from the backend */
+    bool tx;                   /* "tx": TX queue */
+    bool offloads;             /* "offloads": VLAN, header split, striding, CQE compression */
+    uint32_t dev_caps;         /* DEV_CAP_* the properties allow */
+    uint32_t drv_features;     /* DEV_CAP_* the driver acked, all until it writes */
+    uint32_t queue_stopped;    /* BIT(AQ_QTYPE_*) quiesced by STOP_QUEUE */
+
+    /*
+     * Register file, indexed by BAR0 offset / 4 and set up by the register
+     * core from regs_access; reg_map[] is the O(1) dispatch index into it.
+     */
+    uint32_t regs[MMIO_BAR_SIZE / 4];
+    RegisterInfo regs_info[MMIO_BAR_SIZE / 4];
+    RegisterAccessInfo *regs_access;    /* Device-wide plus per-queue entries */
+    RegisterInfoArray *reg_array;
+    RegisterInfo *reg_map[MMIO_BAR_SIZE / 4];
+
+    NICState *nic;             /* PF only: VFs reach the backend through the PF */
+    NICConf conf;
+    NetClientState *nc;
+
+    uint64_t rx_ring_base;
+    uint32_t rx_ring_size;
+    uint32_t rx_head;
+    uint32_t rx_tail;
+    uint32_t rx_hdr_size;      /* Header buffer size for header split */
+    MinimalCQ rx_cq;
+
+    /* RX completions held back to be written as one compressed block */
+    struct cq_entry rx_session[CQE_SESSION_MAX];
+    uint32_t rx_session_cnt;
+    QEMUBH *rx_flush_bh;               /* Flushes the session at end of burst */
+
+    /* Striding RX: many frames packed into consecutive strides of a buffer */
+    uint32_t rx_stride_size;
+    uint32_t rx_stride_num;    /* Strides per posted buffer */
+    uint32_t rx_stride_cur;    /* Next free stride in the buffer at rx_head */
+
+    uint64_t tx_ring_base;
+    uint32_t tx_ring_size;
+    uint32_t tx_head;
+    uint32_t tx_tail;
+    MinimalCQ tx_cq;
+    uint32_t tx_ctrl;
+    uint8_t tx_frame[TX_MAX_FRAME];    /* Staging buffer for one TX frame */
+    QEMUBH *tx_bh;                     /* Drains the TX ring after a doorbell */
+
+    /* Guest memory holding struct event_idx, 0 when notification suppression is off */
+    uint64_t event_base;
+
+    /* Completion vectors, chosen by the driver in CREATE_QUEUE */
+    uint32_t rx_vector;
+    uint32_t tx_vector;
+
+    /* Per-vector interrupt suppression while the guest is polling */
+    uint32_t irq_pending;      /* The mask itself is regs[R_IRQ_MASK] */
+
+    /* RX filter, programmed by the driver's ndo_set_rx_mode */
+    uint32_t rx_ctrl;
+    uint32_t uc_table[UC_TABLE_ENTRIES * 2];    /* {lo, hi} per entry */
+    uint32_t mc_hash[MC_HASH_WORDS];
+    uint32_t vlan_table[VLAN_TABLE_WORDS];
+    uint32_t rx_filter_drops;
+    uint32_t rx_len_errors;    /* Frames larger than the posted buffer or MTU */
+    uint32_t mtu;              /* 0 until set through the admin queue */
+
+    /* Queue counters, snapshotted into guest memory by stats_timer */
+    uint64_t rx_packets;
+    uint64_t rx_bytes;
+    uint64_t tx_packets;
+    uint64_t tx_bytes;
+    uint64_t tx_errors;
+    uint64_t stats_base;       /* struct stats_page, 0 = off */
+    uint32_t stats_interval;   /* ms, 0 = only when requested */
+    uint32_t stats_seq;
+    QEMUTimer *stats_timer;
+
+    /* Admin queue, processed synchronously on the REG_AQ_TAIL doorbell */
+    uint64_t aq_base;
+    uint32_t aq_size;
+    uint32_t aq_head;
+
+    /* Device IOTLB, in use while the guest has ATS enabled */
+    MinimalIOTLBEntry iotlb[IOTLB_ENTRIES];
+    IOMMUNotifier iotlb_notifier;
+    bool iotlb_on;
+
+    /*
+     * Benchmark modes: loop TX back to RX, or generate RX frames at a
+     * fixed rate, without the backend or the host network stack.
+     */
+    uint32_t lb_ctrl;
+    uint32_t lb_drops;
+    uint32_t gen_rate;
+    uint32_t gen_size_min;
+    uint32_t gen_size_max;
+    uint32_t gen_flows;
+    uint32_t gen_seq;          /* Frames generated, picks flow and IP ID */
+    uint32_t gen_rand;         /* LCG state for the frame size */
+    uint64_t gen_credit;       /* Frames owed, in units of 1 / 10^9 */
+    uint8_t gen_frame[TX_MAX_FRAME];
+    QEMUTimer *gen_timer;
+
+    /* Host-side packet capture, off unless "capture" names a file */
+    char *cap_path;
+    uint64_t cap_size;         /* "capture-size": ring bytes */
+    uint32_t cap_snaplen;      /* "capture-snaplen": 0 = whole frame */
+    uint32_t cap_sample;       /* "capture-sample": keep 1 frame in N */
+    uint32_t cap_count;
+    struct cap_ring_hdr *cap;  /* Mapped file, NULL when capture is off */
+} MinimalPCIeNICState;
+
+/*
+ * Guest addresses (*_BASE) are 64-bit: low half at the offset, high half
+ * at offset + 4, or a single 8-byte access.
+ */
+#define REG_RX_RING_BASE   0x10
+#define REG_RX_RING_SIZE   0x18
+#define REG_RX_TAIL        0x1C
+#define REG_RX_HEAD        0x20
+#define REG_RX_CTRL        0x24
+#define REG_RX_FILTER_DROP 0x28    /* RO: frames discarded by the RX filter */
+#define REG_RX_HDR_SIZE    0x2C    /* Size of each rx_desc.hdr_addr buffer */
+#define REG_TX_RING_BASE   0x30
+#define REG_TX_RING_SIZE   0x38
+#define REG_TX_TAIL        0x3C    /* Doorbell: driver posted descriptors up to here */
+#define REG_TX_HEAD        0x40    /* RO: next descriptor the device will send */
+#define REG_IRQ_MASK_SET   0x44    /* W1S: suppress vector N, reads back the mask */
+#define REG_IRQ_MASK_CLR   0x48    /* W1C: re-enable vector N, fires if pending */
+#define R_IRQ_MASK         (REG_IRQ_MASK_CLR / 4)  /* regs[] word holding the mask */
+#define REG_EVENT_BASE     0x50    /* struct event_idx in guest memory, 0 = off */
+#define REG_RX_CQ_BASE     0x58    /* RX completion queue, 0 = complete in place */
+#define REG_TX_CQ_BASE     0x60    /* TX completion queue, 0 = complete in place */
+#define REG_RX_STRIDE_SIZE 0x68    /* Striding RX stride size in bytes, 0 = off */
+#define REG_RX_STRIDE_NUM  0x6C    /* Strides per RX buffer, 0 = off */
+#define REG_DEV_CAPS       0x70    /* RO: DEV_CAP_* optional features */
+#define REG_TX_CTRL        0x74
+#define REG_AQ_BASE        0x78    /* Admin queue of struct aq_cmd */
+#define REG_AQ_SIZE        0x80
+#define REG_AQ_TAIL        0x84    /* Doorbell: commands posted up to here */
+#define REG_AQ_HEAD        0x88    /* RO: next command the device will run */
+#define REG_MAC_LO         0x8C    /* RO: permanent MAC address, bytes 0-3 */
+#define REG_MAC_HI         0x90    /* RO: bytes 4-5, MAC_VALID when assigned */
+#define REG_LB_CTRL        0x94    /* LB_CTRL_*: benchmark modes */
+#define REG_GEN_RATE       0x98    /* Generated frames per second, 0 = fill the ring */
+#define REG_GEN_SIZE_MIN   0x9C    /* Generated frame size range, without FCS */
+#define REG_GEN_SIZE_MAX   0xA0
+#define REG_GEN_FLOWS      0xA4    /* UDP flows, told apart by source port */
+#define REG_LB_DROPS       0xA8    /* RO: looped or generated frames with no buffer */
+#define REG_DRV_FEATURES   0xAC    /* DEV_CAP_* the driver uses, the rest go off */
+#define REG_UC_TABLE       0x100   /* 16 x {lo, hi} perfect-match unicast MACs */
+#define REG_MC_HASH        0x400   /* 4096-bit multicast hash filter */
+#define REG_VLAN_TABLE     0x600   /* 4096-bit VLAN ID filter */
+#define REG_TEST_IRQ       0x00    /* Write: raise MSI/MSI-X vector data & 0xff */
+
+/*
+ * Per-queue register blocks, QREG_STRIDE apart from QREG_BASE. Queue 0's
+ * tails and heads are also reachable at the REG_RX_* / REG_TX_* offsets.
+ */
+#define QREG_BASE          0x800
+#define QREG_STRIDE        0x10
+#define QREG_RX_TAIL       0x0
+#define QREG_RX_HEAD       0x4     /* RO */
+#define QREG_TX_TAIL       0x8
+#define QREG_TX_HEAD       0xC     /* RO */
+
+#define RX_CTRL_PROMISC     (1 << 0)
+#define RX_CTRL_ALLMULTI    (1 << 1)
+#define RX_CTRL_VLAN_FILTER (1 << 2)
+#define RX_CTRL_VLAN_STRIP  (1 << 3)
+#define RX_CTRL_HDR_SPLIT   (1 << 4)
+#define RX_CTRL_CQE_COMPRESS (1 << 5)
+
+#define UC_ENTRY_VALID      (1u << 31)
+#define MAC_VALID           (1u << 31)
+
+#define DEV_CAP_LLQ         (1 << 0)    /* BAR4 accepts pushed TX descriptors */
+#define DEV_CAP_RX          (1 << 1)    /* RX queue */
+#define DEV_CAP_TX          (1 << 2)    /* TX queue */
+#define DEV_CAP_MSI         (1 << 3)
+#define DEV_CAP_MSIX        (1 << 4)
+#define DEV_CAP_VLAN        (1 << 5)    /* VLAN strip, insert and filter */
+#define DEV_CAP_HDR_SPLIT   (1 << 6)
+#define DEV_CAP_RX_STRIDE   (1 << 7)
+#define DEV_CAP_CQE_COMPRESS (1 << 8)
+#define DEV_CAP_EVENT_IDX   (1 << 9)    /* REG_EVENT_BASE notification suppression */
+
+#define LB_CTRL_LOOPBACK    (1 << 0)    /* TX frames come back on RX, nothing leaves */
+#define LB_CTRL_GEN         (1 << 1)    /* RX is fed by the traffic generator */
+
+#define TX_CTRL_LLQ         (1 << 0)    /* Fetch TX descriptors from BAR4 */
+
+struct rx_desc {
+    uint64_t addr;      /* Payload buffer (whole frame unless RX_SPLIT) */
+    uint16_t len;       /* Buffer size from driver, frame length from device */
+    uint16_t flags;
+    uint16_t vlan_tci;  /* Stripped 802.1Q TCI, valid with RX_VLAN */
+    uint16_t hdr_len;   /* Bytes placed at hdr_addr, valid with RX_SPLIT */
+    uint64_t hdr_addr;  /* Header buffer, used in header split mode */
+};
+
+#define RX_DONE  1
+#define RX_VLAN  2
+#define RX_SPLIT 4
+#define RX_BUF_LAST 8   /* Striding RX: device is done with this buffer */
+
+struct tx_desc {
+    uint64_t addr;
+    uint16_t len;
+    uint16_t flags;
+    uint16_t vlan_tci;  /* TCI to insert, valid with TX_VLAN_INSERT */
+    uint16_t hdr_len;   /* LLQ: leading frame bytes pushed inline, addr has the rest */
+};
+
+#define TX_DONE         1
+#define TX_VLAN_INSERT  2
+
+/*
+ * Low-latency queue: with TX_CTRL_LLQ the driver writes each descriptor,
+ * and up to LLQ_HDR_MAX bytes of the frame after it, into BAR4 slot
+ * tx_tail before ringing the doorbell. BAR4 is device RAM, so the writes
+ * don't trap and the device never fetches the descriptor from the guest.
+ */
+#define LLQ_ENTRY_SIZE  256
+#define LLQ_HDR_MAX     128
+#define LLQ_ENTRIES     (LLQ_BAR_SIZE / LLQ_ENTRY_SIZE)
+
+/*
+ * Admin queue command. The driver fills one slot per command and rings
+ * REG_AQ_TAIL; the device writes status and then sets AQ_DONE in place.
+ * Ring setup, filters, MTU and stats go through here instead of one
+ * trapping register write per field.
+ */
+struct aq_cmd {
+    uint16_t opcode;        /* AQ_OPC_* */
+    uint16_t flags;         /* AQ_DONE, written last by the device */
+    uint16_t status;        /* AQ_STATUS_*, valid with AQ_DONE */
+    uint16_t qtype;         /* AQ_QTYPE_*, queue commands */
+    uint32_t val;           /* rx_ctrl, MTU, or AQ_FILTER_* table */
+    uint32_t ring_size;     /* create queue */
+    uint64_t addr;          /* ring base, or the command's payload buffer */
+    uint64_t cq_addr;       /* create queue: completion queue, 0 = in place */
+    uint32_t hdr_size;      /* create RX queue: header split buffer size */
+    uint32_t stride_size;   /* create RX queue: striding, 0 = off */
+    uint32_t stride_num;
+    uint32_t offset;        /* set filter: first table word */
+    uint32_t len;           /* payload: filter words, or stats bytes */
+    uint32_t vector;        /* create queue: completion interrupt vector */
+    uint32_t rsvd[2];
+};
+
+#define AQ_DONE                 1
+
+#define AQ_OPC_CREATE_QUEUE     1
+#define AQ_OPC_DESTROY_QUEUE    2
+#define AQ_OPC_SET_RSS          3
+#define AQ_OPC_SET_RX_CTRL      4
+#define AQ_OPC_SET_FILTER       5
+#define AQ_OPC_QUERY_STATS      6
+#define AQ_OPC_SET_MTU          7
+#define AQ_OPC_SET_STATS        8   /* addr: stats page, val: interval in ms */
+#define AQ_OPC_STOP_QUEUE       9   /* quiesce: the ring is left alone */
+#define AQ_OPC_RESET_QUEUE      10  /* rewind to slot 0 at the same bases */
+
+#define AQ_STATUS_OK            0
+#define AQ_STATUS_BAD_OPCODE    1
+#define AQ_STATUS_INVALID       2
+#define AQ_STATUS_UNSUPPORTED   3
+
+#define AQ_QTYPE_RX             0
+#define AQ_QTYPE_TX             1
+
+#define AQ_FILTER_UC            0   /* REG_UC_TABLE layout */
+#define AQ_FILTER_MC            1
+#define AQ_FILTER_VLAN          2
+
+/* AQ_OPC_QUERY_STATS payload, truncated to the driver's len */
+struct aq_stats {
+    uint32_t rx_filter_drops;
+    uint32_t rx_len_errors;
+};
+
+/*
+ * Counter snapshot the device writes into guest memory, so reading stats
+ * costs the driver no VM exits. seq is odd while a snapshot is being
+ * written; the driver retries until it reads the same even value twice.
+ */
+struct stats_page {
+    uint32_t seq;
+    uint32_t rsvd;
+    uint64_t rx_packets;
+    uint64_t rx_bytes;
+    uint64_t rx_filter_drops;
+    uint64_t rx_len_errors;
+    uint64_t tx_packets;
+    uint64_t tx_bytes;
+    uint64_t tx_errors;
+};
+
+/*
+ * Notification suppression, like virtio's EVENT_IDX. The driver publishes
+ * its tails here and tells the device which head position it wants an
+ * interrupt for; the device says which tail position it wants a doorbell
+ * for. Indices are ring positions.
+ */
+struct event_idx {
+    uint32_t rx_tail;           /* driver: shadow of REG_RX_TAIL */
+    uint32_t rx_used_event;     /* driver: interrupt when RX completions pass this */
+    uint32_t rx_avail_event;    /* device: doorbell when rx_tail passes this */
+    uint32_t tx_tail;           /* driver: shadow of REG_TX_TAIL */
+    uint32_t tx_used_event;     /* driver: interrupt when tx_head passes this */
+    uint32_t tx_avail_event;    /* device: doorbell when tx_tail passes this */
+};
+
+/* Callback; packet received from host (eg. tap or user networking) */
+static ssize_t minimal_receive_packet(NetClientState *nc,
+                                      const uint8_t *buf,
+                                      size_t size);
+
+/* Internal switch: frames a function transmits */
+static void minimal_switch_tx(MinimalPCIeNICState *s,
+                              const uint8_t *buf,
+                              size_t size);
+
+/* Write out held RX completions and interrupt if the driver wants it */
+static void minimal_rx_flush_bh(void *opaque);
+
+/* Admin SET_STATS pushes one counter snapshot right away */
+static void minimal_stats_timer(void *opaque);
+
+/* The PF owning the backend; a PF is its own */
+static MinimalPCIeNICState *minimal_pf(MinimalPCIeNICState *s)
+{
+    PCIDevice *pdev = &s->parent_obj;
+
+    return pci_is_vf(pdev) ? MINIMAL_PCIE_NIC(pcie_sriov_get_pf(pdev)) : s;
+}
+
+/* Offered by the device and not turned off by the driver */
+static bool minimal_feat(MinimalPCIeNICState *s, uint32_t cap)
+{
+    return s->dev_caps & s->drv_features & cap;
+}
+
+/* RX_CTRL bits backed by a negotiated feature; the rest read back as 0 */
+static uint32_t minimal_rx_ctrl_allowed(MinimalPCIeNICState *s, uint32_t val)
+{
+    if (!minimal_feat(s, DEV_CAP_VLAN)) {
+        val &= ~(RX_CTRL_VLAN_FILTER | RX_CTRL_VLAN_STRIP);
+    }
+    if (!minimal_feat(s, DEV_CAP_HDR_SPLIT)) {
+        val &= ~RX_CTRL_HDR_SPLIT;
+    }
+    if (!minimal_feat(s, DEV_CAP_CQE_COMPRESS)) {
+        val &= ~RX_CTRL_CQE_COMPRESS;
+    }
+    return val;
+}
+
+/* Generate MSI/MSI-X interrupt */
+static void minimal_raise_irq(MinimalPCIeNICState *s, uint32_t vector)
+{
+    PCIDevice *pdev = &s->parent_obj;
+
+    if (s->mmio_only) {
+        return;
+    }
+
+    /* Guest is polling this queue: remember the event, don't interrupt */
+    if (vector < 32 && (s->regs[R_IRQ_MASK] & (1u << vector))) {
+        s->irq_pending |= 1u << vector;
+        return;
+    }
+
+    if (s->msix) {
+        if (!msix_enabled(pdev)) {
+            qemu_log_mask(LOG_GUEST_ERROR,
+                          "minimal_pcie_nic: MSI-X not enabled\n");
+        } else if (vector < msix_nr_vectors_allocated(pdev)) {
+            msix_notify(pdev, vector);
+        } else {
+            qemu_log_mask(LOG_GUEST_ERROR,
+                          "minimal_pcie_nic: invalid MSI-X vector %u\n", vector);
+        }
+        return;
+    }
+
+    /* Fallback to MSI */
+    if (msi_enabled(pdev)) {
+        if (vector < msi_nr_vectors_allocated(pdev)) {
+            msi_notify(pdev, vector);
+        } else {
+            qemu_log_mask(LOG_GUEST_ERROR,
+                          "minimal_pcie_nic: invalid MSI vector %u\n", vector);
+        }
+        return;
+    }
+
+    qemu_log_mask(LOG_GUEST_ERROR, "minimal_pcie_nic: interrupts not enabled\n");
+}
+
+/*
+ * The table is sized from the "vectors" property and the PBA sits at a
+ * fixed offset past the largest table MSIX_MAX_VECTORS allows, so the
+ * BAR layout does not move with the vector count.
+ */
+static int
+minimal_init_msix(MinimalPCIeNICState *s, Error **errp)
+{
+    int i, res;
+
+    res = msix_init(PCI_DEVICE(s), s->vectors,
+                    &s->msix_bar,
+                    BAR2_MSIX_IDX,       /* BAR index */
+                    0,                  /* table offset */
+                    &s->msix_bar,
+                    BAR2_MSIX_IDX,       /* PBA BAR index */
+                    MSIX_PBA_OFFSET,
+                    0x98, errp);
+
+    if (res < 0) {
+        return res;
+    }
+
+    for (i = 0; i < s->vectors; i++) {
+        msix_vector_use(PCI_DEVICE(s), i);
+    }
+    return 0;
+}
+
+/*
+ * Filter tables sit in BAR0 outside the register block and are only
+ * accessed as 32-bit words.
+ * Returns the backing word for addr, or NULL if addr is not a table register.
+ */
+static uint32_t *minimal_filter_reg(MinimalPCIeNICState *s, hwaddr addr)
+{
+    if (addr >= REG_UC_TABLE &&
+        addr < REG_UC_TABLE + sizeof(s->uc_table)) {
+        return &s->uc_table[(addr - REG_UC_TABLE) / 4];
+    }
+
+    if (addr >= REG_MC_HASH &&
+        addr < REG_MC_HASH + sizeof(s->mc_hash)) {
+        return &s->mc_hash[(addr - REG_MC_HASH) / 4];
+    }
+
+    if (addr >= REG_VLAN_TABLE &&
+        addr < REG_VLAN_TABLE + sizeof(s->vlan_table)) {
+        return &s->vlan_table[(addr - REG_VLAN_TABLE) / 4];
+    }
+
+    return NULL;
+}
+
+/*
+ * vring_need_event() on ring positions: true if moving an index from old
+ * to new stepped over event.
+ */
+static bool minimal_need_event(uint32_t event, uint32_t new, uint32_t old,
+                               uint32_t size)
+{
+    return (new + 2 * size - event - 1) % size < (new + size - old) % size;
+}
+
+/*
+ * Device IOTLB. Behind a vIOMMU every pci_dma_*() access is translated on
+ * its own; with ATS the device asks for a page's translation once and then
+ * issues pre-translated accesses, so the rings and the buffer pages in
+ * steady use skip the IOMMU. Entries go away on a device-IOTLB
+ * invalidation from the vIOMMU, and all of them when ATS or bus mastering
+ * is turned off.
+ */
+static void minimal_iotlb_flush(MinimalPCIeNICState *s)
+{
+    int i;
+
+    for (i = 0; i < IOTLB_ENTRIES; i++) {
+        s->iotlb[i].perm = IOMMU_NONE;
+    }
+}
+
+static void minimal_iotlb_unmap(IOMMUNotifier *n, IOMMUTLBEntry *inv)
+{
+    MinimalPCIeNICState *s = container_of(n, MinimalPCIeNICState,
+                                          iotlb_notifier);
+    MinimalIOTLBEntry *e;
+    int i;
+
+    for (i = 0; i < IOTLB_ENTRIES; i++) {
+        e = &s->iotlb[i];
+        if (e->perm != IOMMU_NONE &&
+            e->iova <= inv->iova + inv->addr_mask &&
+            inv->iova <= e->iova + e->addr_mask) {
+            e->perm = IOMMU_NONE;
+        }
+    }
+}
+
+/* Follow the ATS Enable and Bus Master bits */
+static void minimal_iotlb_update(MinimalPCIeNICState *s)
+{
+    PCIDevice *pdev = &s->parent_obj;
+    bool on = s->ats && pci_ats_enabled(pdev) &&
+              (pci_get_word(pdev->config + PCI_COMMAND) & PCI_COMMAND_MASTER);
+
+    if (on == s->iotlb_on) {
+        return;
+    }
+
+    minimal_iotlb_flush(s);
+    if (on) {
+        /* Without invalidations the cache can't be trusted: stay off */
+        pci_iommu_init_iotlb_notifier(pdev, &s->iotlb_notifier,
+                                      minimal_iotlb_unmap, s);
+        s->iotlb_on = !pci_iommu_register_iotlb_notifier(pdev, PCI_NO_PASID,
+                                                         &s->iotlb_notifier);
+    } else {
+        pci_iommu_unregister_iotlb_notifier(pdev, PCI_NO_PASID,
+                                            &s->iotlb_notifier);
+        s->iotlb_on = false;
+    }
+}
+
+/* Cached translation for addr, asking the vIOMMU on a miss; NULL on a fault */
+static MinimalIOTLBEntry *minimal_iotlb_lookup(MinimalPCIeNICState *s,
+                                               dma_addr_t addr, bool is_write)
+{
+    MinimalIOTLBEntry *e = &s->iotlb[(addr >> IOTLB_PAGE_BITS) % IOTLB_ENTRIES];
+    IOMMUAccessFlags need = is_write ? IOMMU_WO : IOMMU_RO;
+    IOMMUTLBEntry ret;
+    uint32_t err_count;
+
+    if ((e->perm & need) == need && (addr & ~e->addr_mask) == e->iova) {
+        return e;
+    }
+
+    if (pci_ats_request_translation(&s->parent_obj, PCI_NO_PASID,
+                                    false, false,
+                                    addr & ~((1ULL << IOTLB_PAGE_BITS) - 1),
+                                    1ULL << IOTLB_PAGE_BITS, false,
+                                    &ret, 1, &err_count) != 1 ||
+        (ret.perm & need) != need) {
+        return NULL;
+    }
+
+    e->iova = ret.iova & ~ret.addr_mask;
+    e->addr_mask = ret.addr_mask;
+    e->translated = ret.translated_addr & ~ret.addr_mask;
+    e->as = ret.target_as;
+    e->perm = ret.perm;
+    return e;
+}
+
+/* All device DMA goes through here */
+static MemTxResult minimal_dma_rw(MinimalPCIeNICState *s, dma_addr_t addr,
+                                  void *buf, dma_addr_t len,
+                                  DMADirection dir)
+{
+    bool is_write = dir == DMA_DIRECTION_FROM_DEVICE;
+    MemTxResult res = MEMTX_OK;
+    MinimalIOTLBEntry *e;
+    dma_addr_t chunk;
+
+    if (!s->iotlb_on) {
+        return pci_dma_rw(&s->parent_obj, addr, buf, len, dir,
+                          MEMTXATTRS_UNSPECIFIED);
+    }
+
+    while (len) {
+        e = minimal_iotlb_lookup(s, addr, is_write);
+        if (e) {
+            chunk = MIN(len, e->addr_mask + 1 - (addr & e->addr_mask));
+            res |= address_space_rw(e->as, e->translated |
+                                    (addr & e->addr_mask),
+                                    MEMTXATTRS_UNSPECIFIED, buf, chunk,
+                                    is_write);
+        } else {
+            /* Untranslated, so the vIOMMU sees and reports the fault */
+            chunk = MIN(len, (1ULL << IOTLB_PAGE_BITS) -
+                             (addr & ((1ULL << IOTLB_PAGE_BITS) - 1)));
+            res |= pci_dma_rw(&s->parent_obj, addr, buf, chunk, dir,
+                              MEMTXATTRS_UNSPECIFIED);
+        }
+        addr += chunk;
+        buf = (uint8_t *)buf + chunk;
+        len -= chunk;
+    }
+    return res;
+}
+
+static MemTxResult minimal_dma_read(MinimalPCIeNICState *s, dma_addr_t addr,
+                                    void *buf, dma_addr_t len)
+{
+    return minimal_dma_rw(s, addr, buf, len, DMA_DIRECTION_TO_DEVICE);
+}
+
+static MemTxResult minimal_dma_write(MinimalPCIeNICState *s, dma_addr_t addr,
+                                     const void *buf, dma_addr_t len)
+{
+    return minimal_dma_rw(s, addr, (void *)buf, len,
+                          DMA_DIRECTION_FROM_DEVICE);
+}
+
+static uint32_t minimal_dma_ldl(MinimalPCIeNICState *s, dma_addr_t addr)
+{
+    uint32_t val = 0;
+
+    minimal_dma_read(s, addr, &val, sizeof(val));
+    return le32_to_cpu(val);
+}
+
+static void minimal_dma_stl(MinimalPCIeNICState *s, dma_addr_t addr,
+                            uint32_t val)
+{
+    val = cpu_to_le32(val);
+    minimal_dma_write(s, addr, &val, sizeof(val));
+}
+
+static uint32_t minimal_event_read(MinimalPCIeNICState *s, size_t field)
+{
+    return minimal_dma_ldl(s, s->event_base + field);
+}
+
+static void minimal_event_write(MinimalPCIeNICState *s, size_t field,
+                                uint32_t val)
+{
+    minimal_dma_stl(s, s->event_base + field, val);
+}
+
+static void minimal_cq_reset(MinimalCQ *cq, uint64_t base)
+{
+    cq->base = base;
+    cq->tail = 0;
+    cq->phase = CQE_PHASE;
+}
+
+/* Back to an empty ring at slot 0; ring, CQ and buffer layout are kept */
+static void minimal_rx_rewind(MinimalPCIeNICState *s)
+{
+    s->rx_head = 0;
+    s->rx_tail = 0;
+    s->rx_stride_cur = 0;
+    s->rx_session_cnt = 0;
+    qemu_bh_cancel(s->rx_flush_bh);
+    minimal_cq_reset(&s->rx_cq, s->rx_cq.base);
+    s->queue_stopped &= ~BIT(AQ_QTYPE_RX);
+}
+
+static void minimal_tx_rewind(MinimalPCIeNICState *s)
+{
+    s->tx_head = 0;
+    s->tx_tail = 0;
+    qemu_bh_cancel(s->tx_bh);
+    minimal_cq_reset(&s->tx_cq, s->tx_cq.base);
+    s->queue_stopped &= ~BIT(AQ_QTYPE_TX);
+}
+
+/*
+ * Write the entry at idx. The body goes out first with the stale phase,
+ * so the driver can't see it yet; the flags word with the new phase
+ * lands last.
+ */
+static void minimal_cq_write(MinimalPCIeNICState *s, MinimalCQ *cq,
+                             uint32_t idx, uint16_t phase,
+                             const struct cq_entry *cqe)
+{
+    uint64_t addr = cq->base + idx * sizeof(*cqe);
+    struct cq_entry body = *cqe;
+    uint16_t flags = cqe->flags | phase;
+
+    body.flags = flags ^ CQE_PHASE;
+    minimal_dma_write(s, addr, &body, sizeof(body));
+    smp_wmb();
+    minimal_dma_write(s, addr + offsetof(struct cq_entry, flags),
+                      &flags, sizeof(flags));
+}
+
+static void minimal_cq_advance(MinimalCQ *cq, uint32_t size)
+{
+    if (++cq->tail == size) {
+        cq->tail = 0;
+        cq->phase ^= CQE_PHASE;
+    }
+}
+
+/* Append a completion */
+static void minimal_cq_post(MinimalPCIeNICState *s, MinimalCQ *cq,
+                            uint32_t size, const struct cq_entry *cqe)
+{
+    minimal_cq_write(s, cq, cq->tail, cq->phase, cqe);
+    minimal_cq_advance(cq, size);
+}
+
+/*
+ * Packet capture. Frames are mirrored into a ring of pcapng blocks in a
+ * shared host file, so an external reader sees the traffic without the
+ * guest knowing. Single producer: all callers run under the BQL.
+ */
+#define PCAPNG_SHB              0x0A0D0D0A
+#define PCAPNG_IDB              0x00000001
+#define PCAPNG_EPB              0x00000006
+#define PCAPNG_BOM              0x1A2B3C4D
+#define PCAPNG_LINKTYPE_ETHER   1
+#define PCAPNG_OPT_EPB_FLAGS    2
+#define PCAPNG_EPB_INBOUND      1
+#define PCAPNG_EPB_OUTBOUND     2
+#define PCAPNG_EPB_HLEN         28      /* Before the packet data */
+#define PCAPNG_EPB_TLEN         16      /* epb_flags, opt_endofopt, length */
+
+static int minimal_cap_init(MinimalPCIeNICState *s, Error **errp)
+{
+    uint32_t shb[7] = {
+        PCAPNG_SHB, sizeof(shb), PCAPNG_BOM, 1,     /* v1.0 */
+        UINT32_MAX, UINT32_MAX,                     /* section length unknown */
+        sizeof(shb),
+    };
+    uint32_t idb[5] = {
+        PCAPNG_IDB, sizeof(idb), PCAPNG_LINKTYPE_ETHER, s->cap_snaplen,
+        sizeof(idb),
+    };
+    size_t len = CAP_DATA_OFFSET + s->cap_size;
+    void *map;
+    int fd;
+
+    if (!s->cap_path) {
+        return 0;
+    }
+
+    if (s->cap_size < CAP_SIZE_MIN || !is_power_of_2(s->cap_size)) {
+        error_setg(errp, "capture-size must be a power of 2, at least %llu",
+                   (unsigned long long)CAP_SIZE_MIN);
+        return -1;
+    }
+    if (!s->cap_sample) {
+        error_setg(errp, "capture-sample must be at least 1");
+        return -1;
+    }
+    if (!s->cap_snaplen || s->cap_snaplen > TX_MAX_FRAME) {
+        s->cap_snaplen = TX_MAX_FRAME;
+    }
+    idb[3] = s->cap_snaplen;
+
+    fd = qemu_create(s->cap_path, O_RDWR | O_TRUNC, 0644, errp);
+    if (fd < 0) {
+        return -1;
+    }
+    if (ftruncate(fd, len) < 0) {
+        error_setg_errno(errp, errno, "can't size capture file %s",
+                         s->cap_path);
+        close(fd);
+        return -1;
+    }
+    map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        error_setg_errno(errp, errno, "can't map capture file %s",
+                         s->cap_path);
+        return -1;
+    }
+
+    memcpy((uint8_t *)map + CAP_PCAPNG_OFFSET, shb, sizeof(shb));
+    memcpy((uint8_t *)map + CAP_PCAPNG_OFFSET + sizeof(shb), idb, sizeof(idb));
+
+    s->cap = map;
+    s->cap->version = 1;
+    s->cap->pcapng_len = sizeof(shb) + sizeof(idb);
+    s->cap->pcapng_off = CAP_PCAPNG_OFFSET;
+    s->cap->data_off = CAP_DATA_OFFSET;
+    s->cap->data_size = s->cap_size;
+    s->cap->head = 0;
+    /* Readers check the magic last */
+    qatomic_store_release(&s->cap->magic, CAP_MAGIC);
+    return 0;
+}
+
+static void minimal_cap_exit(MinimalPCIeNICState *s)
+{
+    if (s->cap) {
+        munmap(s->cap, CAP_DATA_OFFSET + s->cap_size);
+        s->cap = NULL;
+    }
+}
+
+static void minimal_cap_write(MinimalPCIeNICState *s, const uint8_t *buf,
+                              size_t size, bool tx)
+{
+    uint8_t *ring = (uint8_t *)s->cap + CAP_DATA_OFFSET;
+    uint64_t head, off, ts;
+    uint32_t caplen, total;
+    uint32_t *w;
+
+    /* Frames that aren't sampled cost a counter increment */
+    if (++s->cap_count < s->cap_sample) {
+        return;
+    }
+    s->cap_count = 0;
+
+    head = s->cap->head;
+    off = head & (s->cap_size - 1);
+    ts = g_get_real_time();                     /* us, pcapng's default */
+    caplen = MIN(size, s->cap_snaplen);
+    total = PCAPNG_EPB_HLEN + ROUND_UP(caplen, 4) + PCAPNG_EPB_TLEN;
+
+    /* Blocks don't wrap: mark the tail as skipped and start over */
+    if (s->cap_size - off < total) {
+        stl_he_p(ring + off, 0);
+        head += s->cap_size - off;
+        off = 0;
+    }
+
+    w = (uint32_t *)(ring + off);
+    w[0] = PCAPNG_EPB;
+    w[1] = total;
+    w[2] = 0;                       /* interface */
+    w[3] = ts >> 32;
+    w[4] = ts;
+    w[5] = caplen;
+    w[6] = size;
+    memcpy(ring + off + PCAPNG_EPB_HLEN, buf, caplen);
+    memset(ring + off + PCAPNG_EPB_HLEN + caplen, 0,
+           ROUND_UP(caplen, 4) - caplen);
+
+    w = (uint32_t *)(ring + off + total - PCAPNG_EPB_TLEN);
+    w[0] = PCAPNG_OPT_EPB_FLAGS | (4 << 16);
+    w[1] = tx ? PCAPNG_EPB_OUTBOUND : PCAPNG_EPB_INBOUND;
+    w[2] = 0;                       /* opt_endofopt */
+    w[3] = total;
+
+    qatomic_store_release(&s->cap->head, head + total);
+}
+
+/* The disabled case is one predictable branch in the data path */
+static inline void minimal_cap(MinimalPCIeNICState *s, const uint8_t *buf,
+                               size_t size, bool tx)
+{
+    if (unlikely(s->cap)) {
+        minimal_cap_write(s, buf, size, tx);
+    }
+}
+
+/*
+ * Fetch TX descriptor idx. Returns the bytes pushed inline with it, or
+ * NULL if it lives in guest memory. Inline headers are only honoured in
+ * LLQ mode, where hdr_len is checked against the slot.
+ */
+static const uint8_t *minimal_tx_fetch(MinimalPCIeNICState *s, uint32_t idx,
+                                       struct tx_desc *desc)
+{
+    uint8_t *entry;
+
+    if (!(s->tx_ctrl & TX_CTRL_LLQ)) {
+        minimal_dma_read(s, s->tx_ring_base + idx * sizeof(*desc),
+                         desc, sizeof(*desc));
+        desc->hdr_len = 0;
+        return NULL;
+    }
+
+    entry = (uint8_t *)memory_region_get_ram_ptr(&s->llq_bar) +
+            idx * LLQ_ENTRY_SIZE;
+    memcpy(desc, entry, sizeof(*desc));
+    if (desc->hdr_len > LLQ_HDR_MAX || desc->hdr_len > desc->len) {
+        desc->len = 0;
+    }
+    return entry + sizeof(*desc);
+}
+
+/* Copy frame bytes [off, off + len): pushed header first, then guest memory */
+static void minimal_tx_read(MinimalPCIeNICState *s, const struct tx_desc *desc,
+                            const uint8_t *hdr, uint8_t *dst,
+                            size_t off, size_t len)
+{
+    size_t n = 0;
+
+    if (off < desc->hdr_len) {
+        n = MIN(len, desc->hdr_len - off);
+        memcpy(dst, hdr + off, n);
+    }
+
+    if (len > n) {
+        minimal_dma_read(s, desc->addr + off + n - desc->hdr_len,
+                         dst + n, len - n);
+    }
+}
+
+/*
+ * Send every descriptor between tx_head and the tail the driver just wrote.
+ * A VLAN tag requested in the descriptor is spliced in while the frame is
+ * copied out of guest memory, so the guest never has to move the header.
+ */
+static void minimal_tx_process(MinimalPCIeNICState *s)
+{
+    struct tx_desc desc;
+    const uint8_t *hdr;
+    size_t len;
+    uint32_t old_head = s->tx_head;
+
+    if (!s->tx_ring_size || !minimal_feat(s, DEV_CAP_TX) ||
+        (s->queue_stopped & BIT(AQ_QTYPE_TX))) {
+        return;
+    }
+
+    while (s->tx_head != s->tx_tail) {
+        hdr = minimal_tx_fetch(s, s->tx_head, &desc);
+
+        len = desc.len;
+        if ((desc.flags & TX_VLAN_INSERT) && minimal_feat(s, DEV_CAP_VLAN)) {
+            if (len < 2 * ETH_ALEN || len + VLAN_HLEN > sizeof(s->tx_frame)) {
+                len = 0;
+            } else {
+                minimal_tx_read(s, &desc, hdr, s->tx_frame, 0, 2 * ETH_ALEN);
+                stw_be_p(s->tx_frame + 2 * ETH_ALEN, ETH_P_VLAN);
+                stw_be_p(s->tx_frame + 2 * ETH_ALEN + 2, desc.vlan_tci);
+                minimal_tx_read(s, &desc, hdr,
+                                s->tx_frame + 2 * ETH_ALEN + VLAN_HLEN,
+                                2 * ETH_ALEN, len - 2 * ETH_ALEN);
+                len += VLAN_HLEN;
+            }
+        } else if (len <= sizeof(s->tx_frame)) {
+            minimal_tx_read(s, &desc, hdr, s->tx_frame, 0, len);
+        } else {
+            len = 0;
+        }
+
+        if (len) {
+            minimal_cap(s, s->tx_frame, len, true);
+            minimal_switch_tx(s, s->tx_frame, len);
+            s->tx_packets++;
+            s->tx_bytes += len;
+        } else {
+            s->tx_errors++;
+            qemu_log_mask(LOG_GUEST_ERROR,
+                          "minimal_pcie_nic: TX bad descriptor %u len=%u\n",
+                          s->tx_head, desc.len);
+        }
+
+        if (s->tx_cq.base) {
+            struct cq_entry cqe = { .id = s->tx_head, .flags = TX_DONE };
+
+            minimal_cq_post(s, &s->tx_cq, s->tx_ring_size, &cqe);
+        } else if (!hdr) {
+            /* Only the flags word is written back */
+            desc.flags = TX_DONE;
+            minimal_dma_write(s, s->tx_ring_base + s->tx_head * sizeof(desc) +
+                              offsetof(struct tx_desc, flags),
+                              &desc.flags, sizeof(desc.flags));
+        }
+        /* An LLQ without a CQ only reports progress through REG_TX_HEAD */
+
+        s->tx_head = (s->tx_head + 1) % s->tx_ring_size;
+    }
+
+    if (s->tx_head == old_head) {
+        return;
+    }
+
+    if (!s->event_base ||
+        minimal_need_event(minimal_event_read(s, offsetof(struct event_idx,
+                                                          tx_used_event)),
+                           s->tx_head, old_head, s->tx_ring_size)) {
+        minimal_raise_irq(s, s->tx_vector);
+    }
+}
+
+/*
+ * TX runs in a bottom half so that, with event_idx, the device can tell the
+ * driver not to ring the doorbell while the ring is already being drained.
+ */
+static void minimal_tx_bh(void *opaque)
+{
+    MinimalPCIeNICState *s = opaque;
+    size_t tail = offsetof(struct event_idx, tx_tail);
+
+    if (!s->tx_ring_size) {
+        return;
+    }
+
+    for (;;) {
+        if (s->event_base) {
+            s->tx_tail = minimal_event_read(s, tail) % s->tx_ring_size;
+        }
+
+        minimal_tx_process(s);
+
+        if (!s->event_base) {
+            return;
+        }
+
+        /* Going idle: ask for a doorbell, then close the race with the driver */
+        minimal_event_write(s, offsetof(struct event_idx, tx_avail_event),
+                            s->tx_tail);
+        if (minimal_event_read(s, tail) % s->tx_ring_size == s->tx_tail) {
+            return;
+        }
+    }
+}
+
+/*
+ * True if the driver has posted an RX descriptor at rx_head. Descriptors
+ * from rx_head up to, not including, rx_tail belong to the device.
+ */
+static bool minimal_rx_avail(MinimalPCIeNICState *s)
+{
+    size_t tail = offsetof(struct event_idx, rx_tail);
+
+    if (s->rx_head != s->rx_tail) {
+        return true;
+    }
+
+    if (!s->event_base) {
+        return false;
+    }
+
+    /* The driver may have posted buffers without a doorbell */
+    s->rx_tail = minimal_event_read(s, tail) % s->rx_ring_size;
+    if (s->rx_head != s->rx_tail) {
+        return true;
+    }
+
+    /* Ring is empty: ask for a doorbell, then close the race with the driver */
+    minimal_event_write(s, offsetof(struct event_idx, rx_avail_event),
+                        s->rx_tail);
+    s->rx_tail = minimal_event_read(s, tail) % s->rx_ring_size;
+    return s->rx_head != s->rx_tail;
+}
+
+/* Unmask vectors and deliver any event that arrived while they were masked */
+/* Raise the vectors that fired while masked and are unmasked now */
+static void minimal_irq_unmasked(MinimalPCIeNICState *s)
+{
+    uint32_t fire = s->irq_pending & ~s->regs[R_IRQ_MASK];
+    int vector;
+
+    s->irq_pending &= ~fire;
+
+    while (fire) {
+        vector = ctz32(fire);
+        fire &= fire - 1;
+        minimal_raise_irq(s, vector);
+    }
+}
+
+static uint16_t minimal_aq_create_queue(MinimalPCIeNICState *s,
+                                        const struct aq_cmd *cmd)
+{
+    if (!cmd->ring_size || cmd->ring_size > UINT16_MAX) {
+        return AQ_STATUS_INVALID;
+    }
+
+    if (cmd->vector >= s->vectors) {
+        return AQ_STATUS_INVALID;
+    }
+
+    if ((cmd->qtype == AQ_QTYPE_RX && !minimal_feat(s, DEV_CAP_RX)) ||
+        (cmd->qtype == AQ_QTYPE_TX && !minimal_feat(s, DEV_CAP_TX)) ||
+        (cmd->stride_num && !minimal_feat(s, DEV_CAP_RX_STRIDE))) {
+        return AQ_STATUS_UNSUPPORTED;
+    }
+
+    if (cmd->qtype == AQ_QTYPE_RX) {
+        s->rx_vector = cmd->vector;
+        s->rx_ring_base = cmd->addr;
+        s->rx_ring_size = cmd->ring_size;
+        s->rx_hdr_size = cmd->hdr_size;
+        s->rx_stride_size = cmd->stride_size;
+        s->rx_stride_num = cmd->stride_num;
+        s->rx_cq.base = cmd->cq_addr;
+        minimal_rx_rewind(s);
+        return AQ_STATUS_OK;
+    }
+
+    if (cmd->qtype == AQ_QTYPE_TX) {
+        s->tx_vector = cmd->vector;
+        s->tx_ring_base = cmd->addr;
+        s->tx_ring_size = cmd->ring_size;
+        if (s->tx_ring_size > LLQ_ENTRIES) {
+            s->tx_ctrl &= ~TX_CTRL_LLQ;
+        }
+        s->tx_cq.base = cmd->cq_addr;
+        minimal_tx_rewind(s);
+        return AQ_STATUS_OK;
+    }
+
+    return AQ_STATUS_INVALID;
+}
+
+/*
+ * Queue-level recovery. STOP makes the device leave the ring alone, with
+ * any held RX completions written out first, so the driver can reclaim
+ * it. RESET rewinds head, tail and CQ to slot 0 and restarts the queue,
+ * keeping the ring and CQ where they are. The other queue keeps running.
+ */
+static uint16_t minimal_aq_queue_ctrl(MinimalPCIeNICState *s,
+                                      const struct aq_cmd *cmd)
+{
+    if (cmd->qtype == AQ_QTYPE_RX && s->rx_ring_size) {
+        if (cmd->opcode == AQ_OPC_STOP_QUEUE) {
+            minimal_rx_flush_bh(s);
+            s->queue_stopped |= BIT(AQ_QTYPE_RX);
+        } else {
+            minimal_rx_rewind(s);
+        }
+        return AQ_STATUS_OK;
+    }
+
+    if (cmd->qtype == AQ_QTYPE_TX && s->tx_ring_size) {
+        if (cmd->opcode == AQ_OPC_STOP_QUEUE) {
+            qemu_bh_cancel(s->tx_bh);
+            s->queue_stopped |= BIT(AQ_QTYPE_TX);
+        } else {
+            minimal_tx_rewind(s);
+        }
+        return AQ_STATUS_OK;
+    }
+
+    return AQ_STATUS_INVALID;
+}
+
+static uint16_t minimal_aq_set_filter(MinimalPCIeNICState *s,
+                                      const struct aq_cmd *cmd)
+{
+    uint32_t *table;
+    size_t words;
+
+    switch (cmd->val) {
+    case AQ_FILTER_UC:
+        table = s->uc_table;
+        words = ARRAY_SIZE(s->uc_table);
+        break;
+    case AQ_FILTER_MC:
+        table = s->mc_hash;
+        words = ARRAY_SIZE(s->mc_hash);
+        break;
+    case AQ_FILTER_VLAN:
+        table = s->vlan_table;
+        words = ARRAY_SIZE(s->vlan_table);
+        break;
+    default:
+        return AQ_STATUS_INVALID;
+    }
+
+    if (cmd->offset > words || cmd->len > words - cmd->offset) {
+        return AQ_STATUS_INVALID;
+    }
+
+    minimal_dma_read(s, cmd->addr, table + cmd->offset,
+                     cmd->len * sizeof(*table));
+    return AQ_STATUS_OK;
+}
+
+static uint16_t minimal_aq_exec(MinimalPCIeNICState *s,
+                                const struct aq_cmd *cmd)
+{
+    struct aq_stats stats;
+
+    switch (cmd->opcode) {
+    case AQ_OPC_CREATE_QUEUE:
+        return minimal_aq_create_queue(s, cmd);
+    case AQ_OPC_DESTROY_QUEUE:
+        if (cmd->qtype == AQ_QTYPE_RX) {
+            /* Completions held for a ring that is going away are dropped */
+            s->rx_ring_size = 0;
+            s->rx_session_cnt = 0;
+        } else if (cmd->qtype == AQ_QTYPE_TX) {
+            s->tx_ring_size = 0;
+        } else {
+            return AQ_STATUS_INVALID;
+        }
+        return AQ_STATUS_OK;
+    case AQ_OPC_STOP_QUEUE:
+    case AQ_OPC_RESET_QUEUE:
+        return minimal_aq_queue_ctrl(s, cmd);
+    case AQ_OPC_SET_RSS:
+        /* Single RX queue: nothing to spread frames over */
+        return AQ_STATUS_UNSUPPORTED;
+    case AQ_OPC_SET_RX_CTRL:
+        s->rx_ctrl = minimal_rx_ctrl_allowed(s, cmd->val);
+        return AQ_STATUS_OK;
+    case AQ_OPC_SET_FILTER:
+        return minimal_aq_set_filter(s, cmd);
+    case AQ_OPC_QUERY_STATS:
+        stats.rx_filter_drops = s->rx_filter_drops;
+        stats.rx_len_errors = s->rx_len_errors;
+        minimal_dma_write(s, cmd->addr, &stats,
+                          MIN(cmd->len, sizeof(stats)));
+        return AQ_STATUS_OK;
+    case AQ_OPC_SET_MTU:
+        /* 68: smallest IPv4 MTU */
+        if (cmd->val < 68 || cmd->val > TX_MAX_FRAME - ETH_HLEN) {
+            return AQ_STATUS_INVALID;
+        }
+        s->mtu = cmd->val;
+        return AQ_STATUS_OK;
+    case AQ_OPC_SET_STATS:
+        /* Snapshot now, then every interval; re-issue to refresh on demand */
+        s->stats_base = cmd->addr;
+        s->stats_interval = cmd->val;
+        timer_del(s->stats_timer);
+        minimal_stats_timer(s);
+        return AQ_STATUS_OK;
+    default:
+        return AQ_STATUS_BAD_OPCODE;
+    }
+}
+
+/* Snapshot the counters into the stats page, bracketed by seq updates */
+static void minimal_stats_write(MinimalPCIeNICState *s)
+{
+    struct stats_page page = {
+        .rx_packets = s->rx_packets,
+        .rx_bytes = s->rx_bytes,
+        .rx_filter_drops = s->rx_filter_drops,
+        .rx_len_errors = s->rx_len_errors,
+        .tx_packets = s->tx_packets,
+        .tx_bytes = s->tx_bytes,
+        .tx_errors = s->tx_errors,
+    };
+    size_t body = offsetof(struct stats_page, rx_packets);
+
+    if (!s->stats_base) {
+        return;
+    }
+
+    s->stats_seq++;
+    minimal_dma_stl(s, s->stats_base, s->stats_seq);
+    smp_wmb();
+    minimal_dma_write(s, s->stats_base + body, (uint8_t *)&page + body,
+                      sizeof(page) - body);
+    smp_wmb();
+    s->stats_seq++;
+    minimal_dma_stl(s, s->stats_base, s->stats_seq);
+}
+
+static void minimal_stats_timer(void *opaque)
+{
+    MinimalPCIeNICState *s = opaque;
+
+    minimal_stats_write(s);
+    if (s->stats_base && s->stats_interval) {
+        timer_mod(s->stats_timer, qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL) +
+                                  s->stats_interval);
+    }
+}
+
+/* Run every command up to the new tail and complete each one in place */
+static void minimal_aq_process(MinimalPCIeNICState *s, uint32_t tail)
+{
+    struct aq_cmd cmd;
+    uint64_t cmd_addr;
+    uint16_t flags = AQ_DONE;
+
+    while (s->aq_head != tail) {
+        cmd_addr = s->aq_base + s->aq_head * sizeof(cmd);
+        minimal_dma_read(s, cmd_addr, &cmd, sizeof(cmd));
+
+        cmd.status = minimal_aq_exec(s, &cmd);
+        if (cmd.status != AQ_STATUS_OK) {
+            qemu_log_mask(LOG_GUEST_ERROR,
+                          "minimal_pcie_nic: admin opcode %u failed status=%u\n",
+                          cmd.opcode, cmd.status);
+        }
+
+        minimal_dma_write(s, cmd_addr + offsetof(struct aq_cmd, status),
+                          &cmd.status, sizeof(cmd.status));
+        smp_wmb();
+        minimal_dma_write(s, cmd_addr + offsetof(struct aq_cmd, flags),
+                          &flags, sizeof(flags));
+
+        s->aq_head = (s->aq_head + 1) % s->aq_size;
+    }
+}
+
+/*
+ * Register side effects. Plain RW registers keep their value in regs[];
+ * the callbacks below move it into device state, or report state that
+ * the device or the admin queue can change behind the register's back.
+ */
+static void minimal_test_irq_pw(RegisterInfo *reg, uint64_t val)
+{
+    /* This is only for msi/msi-x testing */
+    printf("minimal_pcie_nic: trigger IRQ vector=%u\n", (uint32_t)val & 0xff);
+    minimal_raise_irq(reg->opaque, val & 0xff);
+}
+
+/* *_BASE registers: bit 2 of the offset picks the half of the address */
+#define DEFINE_ADDR_REG_PW(fn, field)                                       \
+static void fn(RegisterInfo *reg, uint64_t val)                             \
+{                                                                           \
+    MinimalPCIeNICState *s = reg->opaque;                                   \
+                                                                            \
+    s->field = deposit64(s->field, reg->access->addr & 4 ? 32 : 0, 32, val);\
+}
+
+DEFINE_ADDR_REG_PW(minimal_rx_ring_base_pw, rx_ring_base)
+DEFINE_ADDR_REG_PW(minimal_tx_ring_base_pw, tx_ring_base)
+DEFINE_ADDR_REG_PW(minimal_event_base_set, event_base)
+DEFINE_ADDR_REG_PW(minimal_aq_base_pw, aq_base)
+
+/* Without DEV_CAP_EVENT_IDX the base stays 0: notify on every event */
+static void minimal_event_base_pw(RegisterInfo *reg, uint64_t val)
+{
+    MinimalPCIeNICState *s = reg->opaque;
+
+    if (minimal_feat(s, DEV_CAP_EVENT_IDX)) {
+        minimal_event_base_set(reg, val);
+    }
+}
+
+static void minimal_rx_cq_base_pw(RegisterInfo *reg, uint64_t val)
+{
+    MinimalPCIeNICState *s = reg->opaque;
+
+    s->rx_cq.base = deposit64(s->rx_cq.base, reg->access->addr & 4 ? 32 : 0,
+                              32, val);
+    minimal_cq_reset(&s->rx_cq, s->rx_cq.base);
+    s->rx_session_cnt = 0;
+    s->rx_stride_cur = 0;
+}
+
+static void minimal_tx_cq_base_pw(RegisterInfo *reg, uint64_t val)
+{
+    MinimalPCIeNICState *s = reg->opaque;
+
+    s->tx_cq.base = deposit64(s->tx_cq.base, reg->access->addr & 4 ? 32 : 0,
+                              32, val);
+    minimal_cq_reset(&s->tx_cq, s->tx_cq.base);
+}
+
+/* A new size starts the ring over, like TX; the driver relies on 2^n */
+static void minimal_rx_ring_size_pw(RegisterInfo *reg, uint64_t val)
+{
+    MinimalPCIeNICState *s = reg->opaque;
+
+    if (val && !is_power_of_2(val)) {
+        qemu_log_mask(LOG_GUEST_ERROR,
+                      "minimal_pcie_nic: RX ring size %u not a power of 2\n",
+                      (uint32_t)val);
+        return;
+    }
+    s->rx_ring_size = val;
+    minimal_rx_rewind(s);
+}
+
+static uint64_t minimal_rx_ring_size_pr(RegisterInfo *reg, uint64_t val)
+{
+    MinimalPCIeNICState *s = reg->opaque;
+
+    return s->rx_ring_size;
+}
+
+static void minimal_rx_tail_pw(RegisterInfo *reg, uint64_t val)
+{
+    MinimalPCIeNICState *s = reg->opaque;
+
+    if (s->rx_ring_size) {
+        s->rx_tail = val % s->rx_ring_size;
+        /* Frames held back while the ring was full can go now */
+        qemu_flush_queued_packets(qemu_get_queue(minimal_pf(s)->nic));
+    }
+}
+
+static uint64_t minimal_rx_head_pr(RegisterInfo *reg, uint64_t val)
+{
+    MinimalPCIeNICState *s = reg->opaque;
+
+    return s->rx_head;
+}
+
+/*
+ * Tails read back as the device sees them, which with event_idx is the
+ * last shadow it fetched rather than the last doorbell: ring diagnostics.
+ */
+static uint64_t minimal_rx_tail_pr(RegisterInfo *reg, uint64_t val)
+{
+    MinimalPCIeNICState *s = reg->opaque;
+
+    return s->rx_tail;
+}
+
+static void minimal_rx_ctrl_pw(RegisterInfo *reg, uint64_t val)
+{
+    MinimalPCIeNICState *s = reg->opaque;
+
+    s->rx_ctrl = minimal_rx_ctrl_allowed(s, val);
+}
+
+static uint64_t minimal_rx_ctrl_pr(RegisterInfo *reg, uint64_t val)
+{
+    MinimalPCIeNICState *s = reg->opaque;
+
+    return s->rx_ctrl;
+}
+
+static uint64_t minimal_rx_filter_drop_pr(RegisterInfo *reg, uint64_t val)
+{
+    MinimalPCIeNICState *s = reg->opaque;
+
+    return s->rx_filter_drops;
+}
+
+static void minimal_rx_hdr_size_pw(RegisterInfo *reg, uint64_t val)
+{
+    MinimalPCIeNICState *s = reg->opaque;
+
+    s->rx_hdr_size = val;
+}
+
+static void minimal_rx_stride_size_pw(RegisterInfo *reg, uint64_t val)
+{
+    MinimalPCIeNICState *s = reg->opaque;
+
+    s->rx_stride_size = minimal_feat(s, DEV_CAP_RX_STRIDE) ? val : 0;
+    s->rx_stride_cur = 0;
+}
+
+static void minimal_rx_stride_num_pw(RegisterInfo *reg, uint64_t val)
+{
+    MinimalPCIeNICState *s = reg->opaque;
+
+    s->rx_stride_num = minimal_feat(s, DEV_CAP_RX_STRIDE) ? val : 0;
+    s->rx_stride_cur = 0;
+}
+
+static void minimal_tx_ring_size_pw(RegisterInfo *reg, uint64_t val)
+{
+    MinimalPCIeNICState *s = reg->opaque;
+
+    s->tx_ring_size = val;
+    s->tx_head = 0;
+    if (s->tx_ring_size > LLQ_ENTRIES) {
+        s->tx_ctrl &= ~TX_CTRL_LLQ;
+    }
+    minimal_cq_reset(&s->tx_cq, s->tx_cq.base);
+}
+
+static void minimal_tx_tail_pw(RegisterInfo *reg, uint64_t val)
+{
+    MinimalPCIeNICState *s = reg->opaque;
+
+    if (s->tx_ring_size) {
+        s->tx_tail = val % s->tx_ring_size;
+        qemu_bh_schedule(s->tx_bh);
+    }
+}
+
+static uint64_t minimal_tx_head_pr(RegisterInfo *reg, uint64_t val)
+{
+    MinimalPCIeNICState *s = reg->opaque;
+
+    return s->tx_head;
+}
+
+static uint64_t minimal_tx_tail_pr(RegisterInfo *reg, uint64_t val)
+{
+    MinimalPCIeNICState *s = reg->opaque;
+
+    return s->tx_tail;
+}
+
+static void minimal_tx_ctrl_pw(RegisterInfo *reg, uint64_t val)
+{
+    MinimalPCIeNICState *s = reg->opaque;
+
+    /* BAR4 only has room for LLQ_ENTRIES descriptors */
+    if ((val & TX_CTRL_LLQ) && (!minimal_feat(s, DEV_CAP_LLQ) ||
+                                s->tx_ring_size > LLQ_ENTRIES)) {
+        qemu_log_mask(LOG_GUEST_ERROR,
+                      "minimal_pcie_nic: LLQ unavailable for ring size %u\n",
+                      s->tx_ring_size);
+        val &= ~TX_CTRL_LLQ;
+    }
+    s->tx_ctrl = val;
+}
+
+static uint64_t minimal_tx_ctrl_pr(RegisterInfo *reg, uint64_t val)
+{
+    MinimalPCIeNICState *s = reg->opaque;
+
+    return s->tx_ctrl;
+}
+
+static void minimal_irq_mask_set_pw(RegisterInfo *reg, uint64_t val)
+{
+    MinimalPCIeNICState *s = reg->opaque;
+
+    s->regs[R_IRQ_MASK] |= val;
+}
+
+static uint64_t minimal_irq_mask_pr(RegisterInfo *reg, uint64_t val)
+{
+    MinimalPCIeNICState *s = reg->opaque;
+
+    return s->regs[R_IRQ_MASK];
+}
+
+/* The register core has already cleared the written bits (.w1c) */
+static void minimal_irq_mask_clr_pw(RegisterInfo *reg, uint64_t val)
+{
+    minimal_irq_unmasked(reg->opaque);
+}
+
+static uint64_t minimal_dev_caps_pr(RegisterInfo *reg, uint64_t val)
+{
+    MinimalPCIeNICState *s = reg->opaque;
+
+    return s->dev_caps;
+}
+
+static void minimal_drv_features_pw(RegisterInfo *reg, uint64_t val)
+{
+    MinimalPCIeNICState *s = reg->opaque;
+
+    s->drv_features = val & s->dev_caps;
+    s->rx_ctrl = minimal_rx_ctrl_allowed(s, s->rx_ctrl);
+}
+
+static uint64_t minimal_drv_features_pr(RegisterInfo *reg, uint64_t val)
+{
+    MinimalPCIeNICState *s = reg->opaque;
+
+    return s->drv_features;
+}
+
+static void minimal_aq_size_pw(RegisterInfo *reg, uint64_t val)
+{
+    MinimalPCIeNICState *s = reg->opaque;
+
+    s->aq_size = val;
+    s->aq_head = 0;
+}
+
+static void minimal_aq_tail_pw(RegisterInfo *reg, uint64_t val)
+{
+    MinimalPCIeNICState *s = reg->opaque;
+
+    if (s->aq_size) {
+        minimal_aq_process(s, val % s->aq_size);
+    }
+}
+
+static uint64_t minimal_aq_head_pr(RegisterInfo *reg, uint64_t val)
+{
+    MinimalPCIeNICState *s = reg->opaque;
+
+    return s->aq_head;
+}
+
+static uint64_t minimal_mac_lo_pr(RegisterInfo *reg, uint64_t val)
+{
+    MinimalPCIeNICState *s = reg->opaque;
+
+    return ldl_le_p(s->conf.macaddr.a);
+}
+
+static uint64_t minimal_mac_hi_pr(RegisterInfo *reg, uint64_t val)
+{
+    MinimalPCIeNICState *s = reg->opaque;
+
+    return lduw_le_p(s->conf.macaddr.a + 4) | MAC_VALID;
+}
+
+static void minimal_lb_ctrl_pw(RegisterInfo *reg, uint64_t val)
+{
+    MinimalPCIeNICState *s = reg->opaque;
+
+    s->lb_ctrl = val & (LB_CTRL_LOOPBACK | LB_CTRL_GEN);
+    if (!(s->lb_ctrl & LB_CTRL_GEN)) {
+        timer_del(s->gen_timer);
+    } else if (!timer_pending(s->gen_timer)) {
+        s->gen_credit = 0;
+        timer_mod(s->gen_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
+    }
+}
+
+static uint64_t minimal_lb_ctrl_pr(RegisterInfo *reg, uint64_t val)
+{
+    MinimalPCIeNICState *s = reg->opaque;
+
+    return s->lb_ctrl;
+}
+
+/* Plain 32-bit settings, taken as written */
+#define DEFINE_FIELD_REG_PW(fn, field)                                      \
+static void fn(RegisterInfo *reg, uint64_t val)                             \
+{                                                                           \
+    MinimalPCIeNICState *s = reg->opaque;                                   \
+                                                                            \
+    s->field = val;                                                         \
+}
+
+DEFINE_FIELD_REG_PW(minimal_gen_rate_pw, gen_rate)
+DEFINE_FIELD_REG_PW(minimal_gen_size_min_pw, gen_size_min)
+DEFINE_FIELD_REG_PW(minimal_gen_size_max_pw, gen_size_max)
+DEFINE_FIELD_REG_PW(minimal_gen_flows_pw, gen_flows)
+
+static uint64_t minimal_lb_drops_pr(RegisterInfo *reg, uint64_t val)
+{
+    MinimalPCIeNICState *s = reg->opaque;
+
+    return s->lb_drops;
+}
+
+#define REG_RO_ALL  0xffffffff
+#define REG_W1C_ALL 0xffffffff
+
+/* Device-wide control registers */
+static const RegisterAccessInfo minimal_regs_access[] = {
+    { .name = "TEST_IRQ", .addr = REG_TEST_IRQ,
+      .post_write = minimal_test_irq_pw },
+    { .name = "RX_RING_BASE_LO", .addr = REG_RX_RING_BASE,
+      .post_write = minimal_rx_ring_base_pw },
+    { .name = "RX_RING_BASE_HI", .addr = REG_RX_RING_BASE + 4,
+      .post_write = minimal_rx_ring_base_pw },
+    { .name = "RX_RING_SIZE", .addr = REG_RX_RING_SIZE,
+      .post_write = minimal_rx_ring_size_pw,
+      .post_read = minimal_rx_ring_size_pr },
+    { .name = "RX_TAIL", .addr = REG_RX_TAIL,
+      .post_write = minimal_rx_tail_pw, .post_read = minimal_rx_tail_pr },
+    { .name = "RX_HEAD", .addr = REG_RX_HEAD, .ro = REG_RO_ALL,
+      .post_read = minimal_rx_head_pr },
+    { .name = "RX_CTRL", .addr = REG_RX_CTRL, .reset = RX_CTRL_PROMISC,
+      .post_write = minimal_rx_ctrl_pw, .post_read = minimal_rx_ctrl_pr },
+    { .name = "RX_FILTER_DROP", .addr = REG_RX_FILTER_DROP, .ro = REG_RO_ALL,
+      .post_read = minimal_rx_filter_drop_pr },
+    { .name = "RX_HDR_SIZE", .addr = REG_RX_HDR_SIZE,
+      .post_write = minimal_rx_hdr_size_pw },
+    { .name = "TX_RING_BASE_LO", .addr = REG_TX_RING_BASE,
+      .post_write = minimal_tx_ring_base_pw },
+    { .name = "TX_RING_BASE_HI", .addr = REG_TX_RING_BASE + 4,
+      .post_write = minimal_tx_ring_base_pw },
+    { .name = "TX_RING_SIZE", .addr = REG_TX_RING_SIZE,
+      .post_write = minimal_tx_ring_size_pw },
+    { .name = "TX_TAIL", .addr = REG_TX_TAIL,
+      .post_write = minimal_tx_tail_pw, .post_read = minimal_tx_tail_pr },
+    { .name = "TX_HEAD", .addr = REG_TX_HEAD, .ro = REG_RO_ALL,
+      .post_read = minimal_tx_head_pr },
+    { .name = "IRQ_MASK_SET", .addr = REG_IRQ_MASK_SET,
+      .post_write = minimal_irq_mask_set_pw, .post_read = minimal_irq_mask_pr },
+    { .name = "IRQ_MASK_CLR", .addr = REG_IRQ_MASK_CLR, .w1c = REG_W1C_ALL,
+      .post_write = minimal_irq_mask_clr_pw },
+    { .name = "EVENT_BASE_LO", .addr = REG_EVENT_BASE,
+      .post_write = minimal_event_base_pw },
+    { .name = "EVENT_BASE_HI", .addr = REG_EVENT_BASE + 4,
+      .post_write = minimal_event_base_pw },
+    { .name = "RX_CQ_BASE_LO", .addr = REG_RX_CQ_BASE,
+      .post_write = minimal_rx_cq_base_pw },
+    { .name = "RX_CQ_BASE_HI", .addr = REG_RX_CQ_BASE + 4,
+      .post_write = minimal_rx_cq_base_pw },
+    { .name = "TX_CQ_BASE_LO", .addr = REG_TX_CQ_BASE,
+      .post_write = minimal_tx_cq_base_pw },
+    { .name = "TX_CQ_BASE_HI", .addr = REG_TX_CQ_BASE + 4,
+      .post_write = minimal_tx_cq_base_pw },
+    { .name = "RX_STRIDE_SIZE", .addr = REG_RX_STRIDE_SIZE,
+      .post_write = minimal_rx_stride_size_pw },
+    { .name = "RX_STRIDE_NUM", .addr = REG_RX_STRIDE_NUM,
+      .post_write = minimal_rx_stride_num_pw },
+    { .name = "DEV_CAPS", .addr = REG_DEV_CAPS, .ro = REG_RO_ALL,
+      .post_read = minimal_dev_caps_pr },
+    { .name = "TX_CTRL", .addr = REG_TX_CTRL,
+      .post_write = minimal_tx_ctrl_pw, .post_read = minimal_tx_ctrl_pr },
+    { .name = "AQ_BASE_LO", .addr = REG_AQ_BASE,
+      .post_write = minimal_aq_base_pw },
+    { .name = "AQ_BASE_HI", .addr = REG_AQ_BASE + 4,
+      .post_write = minimal_aq_base_pw },
+    { .name = "AQ_SIZE", .addr = REG_AQ_SIZE,
+      .post_write = minimal_aq_size_pw },
+    { .name = "AQ_TAIL", .addr = REG_AQ_TAIL,
+      .post_write = minimal_aq_tail_pw },
+    { .name = "AQ_HEAD", .addr = REG_AQ_HEAD, .ro = REG_RO_ALL,
+      .post_read = minimal_aq_head_pr },
+    { .name = "MAC_LO", .addr = REG_MAC_LO, .ro = REG_RO_ALL,
+      .post_read = minimal_mac_lo_pr },
+    { .name = "MAC_HI", .addr = REG_MAC_HI, .ro = REG_RO_ALL,
+      .post_read = minimal_mac_hi_pr },
+    { .name = "LB_CTRL", .addr = REG_LB_CTRL,
+      .post_write = minimal_lb_ctrl_pw, .post_read = minimal_lb_ctrl_pr },
+    { .name = "GEN_RATE", .addr = REG_GEN_RATE,
+      .post_write = minimal_gen_rate_pw },
+    { .name = "GEN_SIZE_MIN", .addr = REG_GEN_SIZE_MIN, .reset = ETH_ZLEN,
+      .post_write = minimal_gen_size_min_pw },
+    { .name = "GEN_SIZE_MAX", .addr = REG_GEN_SIZE_MAX, .reset = ETH_ZLEN,
+      .post_write = minimal_gen_size_max_pw },
+    { .name = "GEN_FLOWS", .addr = REG_GEN_FLOWS, .reset = 1,
+      .post_write = minimal_gen_flows_pw },
+    { .name = "LB_DROPS", .addr = REG_LB_DROPS, .ro = REG_RO_ALL,
+      .post_read = minimal_lb_drops_pr },
+    { .name = "DRV_FEATURES", .addr = REG_DRV_FEATURES,
+      .post_write = minimal_drv_features_pw,
+      .post_read = minimal_drv_features_pr },
+};
+
+/* One block per queue; .addr is relative to the block. Single queue today. */
+static const RegisterAccessInfo minimal_qregs_template[] = {
+    { .name = "Q_RX_TAIL", .addr = QREG_RX_TAIL,
+      .post_write = minimal_rx_tail_pw, .post_read = minimal_rx_tail_pr },
+    { .name = "Q_RX_HEAD", .addr = QREG_RX_HEAD, .ro = REG_RO_ALL,
+      .post_read = minimal_rx_head_pr },
+    { .name = "Q_TX_TAIL", .addr = QREG_TX_TAIL,
+      .post_write = minimal_tx_tail_pw, .post_read = minimal_tx_tail_pr },
+    { .name = "Q_TX_HEAD", .addr = QREG_TX_HEAD, .ro = REG_RO_ALL,
+      .post_read = minimal_tx_head_pr },
+};
+
+#undef REG_RO_ALL
+#undef REG_W1C_ALL
+
+#define NUM_REGS (ARRAY_SIZE(minimal_regs_access) + \
+                  QUEUE_MAX * ARRAY_SIZE(minimal_qregs_template))
+
+/* Power-on values from .reset; post_write side effects are not replayed */
+static void minimal_regs_reset(MinimalPCIeNICState *s)
+{
+    RegisterInfo *r;
+    int i;
+
+    for (i = 0; i < s->reg_array->num_elements; i++) {
+        r = s->reg_array->r[i];
+        *(uint32_t *)r->data = r->access->reset;
+    }
+}
+
+/* BAR0 callbacks get the register block; each register's opaque is the NIC */
+static MinimalPCIeNICState *minimal_regs_dev(void *opaque)
+{
+    RegisterInfoArray *ra = opaque;
+
+    return MINIMAL_PCIE_NIC(ra->r[0]->opaque);
+}
+
+/* MMIO read callback: 32-bit accesses, 64-bit ones are split by the core */
+static uint64_t minimal_mmio_read(void *opaque, hwaddr addr, unsigned size)
+{
+    MinimalPCIeNICState *s = minimal_regs_dev(opaque);
+    RegisterInfo *r = s->reg_map[addr / 4];
+    uint32_t *reg;
+
+    if (r) {
+        return register_read(r, UINT32_MAX, "minimal_pcie_nic", false);
+    }
+
+    reg = minimal_filter_reg(s, addr);
+    if (reg) {
+        return *reg;
+    }
+
+    qemu_log_mask(LOG_GUEST_ERROR,
+                  "minimal_pcie_nic: MMIO read unknown register addr=%#" PRIx64
+                  "\n", (uint64_t)addr);
+    return 0;
+}
+
+/* MMIO write callback */
+static void minimal_mmio_write(void *opaque,
+                               hwaddr addr,
+                               uint64_t data,
+                               unsigned size)
+{
+    MinimalPCIeNICState *s = minimal_regs_dev(opaque);
+    RegisterInfo *r = s->reg_map[addr / 4];
+    uint32_t *reg;
+
+    if (r) {
+        register_write(r, data, UINT32_MAX, "minimal_pcie_nic", false);
+        return;
+    }
+
+    reg = minimal_filter_reg(s, addr);
+    if (reg) {
+        *reg = data;
+        return;
+    }
+
+    qemu_log_mask(LOG_GUEST_ERROR,
+                  "minimal_pcie_nic: MMIO write unknown register addr=%#" PRIx64
+                  " data=0x%llx\n", (uint64_t)addr, (unsigned long long)data);
+}
+
+/* MemoryRegionOps for the MMIO region */
+static const MemoryRegionOps minimal_mmio_ops = {
+    .read = minimal_mmio_read,
+    .write = minimal_mmio_write,
+    .endianness = DEVICE_NATIVE_ENDIAN,
+    .valid = {
+        .min_access_size = 4,
+        .max_access_size = 8,       /* writeq() of a *_BASE register */
+    },
+    .impl = {
+        .min_access_size = 4,
+        .max_access_size = 4,
+    },
+};
+
+/*
+ * Build the register block, device-wide entries followed by one copy of
+ * the queue template per queue, and the offset -> register map.
+ */
+static void minimal_regs_init(MinimalPCIeNICState *s)
+{
+    size_t nr = ARRAY_SIZE(minimal_regs_access);
+    size_t nq = ARRAY_SIZE(minimal_qregs_template);
+    RegisterAccessInfo *ac;
+    int i, q;
+
+    s->regs_access = g_new0(RegisterAccessInfo, NUM_REGS);
+    memcpy(s->regs_access, minimal_regs_access, sizeof(minimal_regs_access));
+    for (q = 0; q < QUEUE_MAX; q++) {
+        for (i = 0; i < nq; i++) {
+            ac = &s->regs_access[nr + q * nq + i];
+            *ac = minimal_qregs_template[i];
+            ac->addr += QREG_BASE + q * QREG_STRIDE;
+        }
+    }
+
+    s->reg_array = register_init_block32(DEVICE(s), s->regs_access, NUM_REGS,
+                                         s->regs_info, s->regs,
+                                         &minimal_mmio_ops, false,
+                                         MMIO_BAR_SIZE);
+    for (i = 0; i < NUM_REGS; i++) {
+        ac = &s->regs_access[i];
+        assert(ac->addr < MMIO_BAR_SIZE && !s->reg_map[ac->addr / 4]);
+        s->reg_map[ac->addr / 4] = s->reg_array->r[i];
+    }
+    minimal_regs_reset(s);
+}
+
+static void minimal_regs_free(MinimalPCIeNICState *s)
+{
+    memory_region_del_subregion(&s->mmio, &s->reg_array->mem);
+    register_finalize_block(s->reg_array);
+    g_free(s->regs_access);
+}
+
+/* True if addr is in the perfect-match unicast table */
+static bool minimal_rx_uc_match(MinimalPCIeNICState *s, const uint8_t *addr)
+{
+    uint32_t lo = ldl_le_p(addr);
+    uint32_t hi = lduw_le_p(addr + 4) | UC_ENTRY_VALID;
+    int i;
+
+    for (i = 0; i < UC_TABLE_ENTRIES; i++) {
+        if (s->uc_table[i * 2] == lo && s->uc_table[i * 2 + 1] == hi) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*
+ * RX address filter: decide whether a frame is wanted by the guest before
+ * it consumes a descriptor, DMA bandwidth or an interrupt.
+ */
+static bool minimal_rx_filter(MinimalPCIeNICState *s,
+                              const uint8_t *buf,
+                              size_t size)
+{
+    const struct eth_header *eh = (const struct eth_header *)buf;
+    uint32_t bit;
+    uint16_t vid;
+
+    if (size < ETH_HLEN) {
+        return false;
+    }
+
+    /* VLAN filter applies before the address match */
+    if ((s->rx_ctrl & RX_CTRL_VLAN_FILTER) &&
+        lduw_be_p(&eh->h_proto) == ETH_P_VLAN) {
+        if (size < ETH_HLEN + sizeof(struct vlan_header)) {
+            return false;
+        }
+        vid = lduw_be_p(buf + ETH_HLEN) & 0xfff;
+        if (!(s->vlan_table[vid / 32] & (1u << (vid % 32)))) {
+            return false;
+        }
+    }
+
+    if (s->rx_ctrl & RX_CTRL_PROMISC) {
+        return true;
+    }
+
+    if (is_broadcast_ether_addr(eh->h_dest)) {
+        return true;
+    }
+
+    if (is_multicast_ether_addr(eh->h_dest)) {
+        if (s->rx_ctrl & RX_CTRL_ALLMULTI) {
+            return true;
+        }
+        /* Top 12 bits of the big-endian CRC index the 4096-bit table */
+        bit = net_crc32(eh->h_dest, ETH_ALEN) >> 20;
+        return s->mc_hash[bit / 32] & (1u << (bit % 32));
+    }
+
+    return minimal_rx_uc_match(s, eh->h_dest);
+}
+
+/*
+ * Length of the L2-L4 headers (Ethernet, optional 802.1Q, IPv4/IPv6,
+ * TCP/UDP) of a frame, or 0 if it can't be split.
+ */
+static size_t minimal_rx_hdr_len(const uint8_t *buf, size_t size)
+{
+    size_t off = ETH_HLEN;
+    uint16_t proto;
+    uint8_t l4;
+
+    if (size < ETH_HLEN) {
+        return 0;
+    }
+
+    proto = lduw_be_p(buf + 2 * ETH_ALEN);
+    if (proto == ETH_P_VLAN) {
+        if (size < ETH_HLEN + VLAN_HLEN) {
+            return 0;
+        }
+        proto = lduw_be_p(buf + ETH_HLEN + 2);
+        off += VLAN_HLEN;
+    }
+
+    switch (proto) {
+    case ETH_P_IP:
+        /* Fragments other than the first carry no L4 header */
+        if (size < off + 20 || (lduw_be_p(buf + off + 6) & 0x1fff)) {
+            return 0;
+        }
+        l4 = buf[off + 9];
+        off += (buf[off] & 0xf) * 4;
+        break;
+    case ETH_P_IPV6:
+        if (size < off + 40) {
+            return 0;
+        }
+        l4 = buf[off + 6];
+        off += 40;
+        break;
+    default:
+        return 0;
+    }
+
+    switch (l4) {
+    case IP_PROTO_TCP:
+        if (size < off + 20) {
+            return 0;
+        }
+        off += (buf[off + 12] >> 4) * 4;
+        break;
+    case IP_PROTO_UDP:
+        off += 8;
+        break;
+    default:
+        /* Unknown L4: split after the IP header */
+        break;
+    }
+
+    return off <= size ? off : 0;
+}
+
+/*
+ * DMA bytes [off, off + len) of the frame described by iov to dst.
+ * iov is the frame as the guest sees it, i.e. without a stripped tag.
+ */
+static void minimal_rx_dma(MinimalPCIeNICState *s, dma_addr_t dst,
+                           const struct iovec *iov, int iovcnt,
+                           size_t off, size_t len)
+{
+    size_t chunk;
+    int i;
+
+    for (i = 0; i < iovcnt && len; i++) {
+        if (off >= iov[i].iov_len) {
+            off -= iov[i].iov_len;
+            continue;
+        }
+        chunk = MIN(iov[i].iov_len - off, len);
+        minimal_dma_write(s, dst,
+                          (uint8_t *)iov[i].iov_base + off, chunk);
+        dst += chunk;
+        len -= chunk;
+        off = 0;
+    }
+}
+
+/*
+ * Describe the frame as the guest will see it. With RX_CTRL_VLAN_STRIP
+ * the 802.1Q tag is cut out of iov and reported through flags/vlan_tci.
+ * Returns the length the guest receives.
+ */
+static size_t minimal_rx_frame(MinimalPCIeNICState *s,
+                               const uint8_t *buf, size_t size,
+                               struct iovec *iov, int *iovcnt,
+                               uint16_t *flags, uint16_t *vlan_tci)
+{
+    if ((s->rx_ctrl & RX_CTRL_VLAN_STRIP) &&
+        size >= ETH_HLEN + VLAN_HLEN &&
+        lduw_be_p(buf + 2 * ETH_ALEN) == ETH_P_VLAN) {
+        /* Strip the tag by DMAing around it and report the TCI */
+        *vlan_tci = lduw_be_p(buf + 2 * ETH_ALEN + 2);
+        *flags |= RX_VLAN;
+
+        iov[0].iov_base = (void *)buf;
+        iov[0].iov_len = 2 * ETH_ALEN;
+        iov[1].iov_base = (void *)(buf + 2 * ETH_ALEN + VLAN_HLEN);
+        iov[1].iov_len = size - 2 * ETH_ALEN - VLAN_HLEN;
+        *iovcnt = 2;
+        return size - VLAN_HLEN;
+    }
+
+    iov[0].iov_base = (void *)buf;
+    iov[0].iov_len = size;
+    *iovcnt = 1;
+    return size;
+}
+
+static bool minimal_rx_striding(MinimalPCIeNICState *s)
+{
+    return s->rx_cq.base && s->rx_stride_size && s->rx_stride_num;
+}
+
+/* A striding buffer can complete once per stride, so the CQ is that much deeper */
+static uint32_t minimal_rx_cq_size(MinimalPCIeNICState *s)
+{
+    return s->rx_ring_size * (minimal_rx_striding(s) ? s->rx_stride_num : 1);
+}
+
+/* Position the driver's rx_used_event refers to: CQ tail, or ring head */
+static uint32_t minimal_rx_done_idx(MinimalPCIeNICState *s)
+{
+    return s->rx_cq.base ? s->rx_cq.tail : s->rx_head;
+}
+
+static uint32_t minimal_rx_done_size(MinimalPCIeNICState *s)
+{
+    return s->rx_cq.base ? minimal_rx_cq_size(s) : s->rx_ring_size;
+}
+
+/* Is cqe the next implied entry of the compressed block being collected? */
+static bool minimal_rx_session_fits(MinimalPCIeNICState *s,
+                                    const struct cq_entry *cqe)
+{
+    const struct cq_entry *first = &s->rx_session[0];
+    const struct cq_entry *last = &s->rx_session[s->rx_session_cnt - 1];
+
+    if (cqe->flags != first->flags || cqe->vlan_tci != first->vlan_tci ||
+        cqe->hdr_len || !cqe->len) {
+        return false;
+    }
+
+    if (minimal_rx_striding(s)) {
+        return cqe->id == last->id &&
+               cqe->stride == last->stride +
+                              DIV_ROUND_UP(last->len, s->rx_stride_size);
+    }
+
+    return cqe->id == (last->id + 1) % s->rx_ring_size;
+}
+
+/*
+ * Write out the collected RX completions: a single entry as is, several
+ * as a title followed by packed length arrays. The title slot is reserved
+ * first and published last, so the driver sees the block all at once.
+ */
+static void minimal_rx_flush(MinimalPCIeNICState *s)
+{
+    uint32_t size = minimal_rx_cq_size(s);
+    uint32_t n = s->rx_session_cnt;
+    struct cq_entry title, mini;
+    uint16_t *lens = (uint16_t *)&mini;
+    uint32_t title_idx, i, j;
+    uint16_t title_phase;
+
+    if (!n) {
+        return;
+    }
+    s->rx_session_cnt = 0;
+
+    if (n == 1) {
+        minimal_cq_post(s, &s->rx_cq, size, &s->rx_session[0]);
+        return;
+    }
+
+    title_idx = s->rx_cq.tail;
+    title_phase = s->rx_cq.phase;
+    minimal_cq_advance(&s->rx_cq, size);
+
+    for (i = 1; i < n; i += CQE_MINI_PER_ENTRY) {
+        memset(&mini, 0, sizeof(mini));
+        for (j = 0; j < CQE_MINI_PER_ENTRY && i + j < n; j++) {
+            lens[j < CQE_MINI_FLAGS ? j : j + 1] = s->rx_session[i + j].len;
+        }
+        mini.flags = s->rx_cq.phase ^ CQE_PHASE;
+        minimal_dma_write(s,
+                          s->rx_cq.base + s->rx_cq.tail * sizeof(mini),
+                          &mini, sizeof(mini));
+        minimal_cq_advance(&s->rx_cq, size);
+    }
+
+    title = s->rx_session[0];
+    title.flags |= CQE_COMPRESSED;
+    title.hdr_len = n;
+    minimal_cq_write(s, &s->rx_cq, title_idx, title_phase, &title);
+}
+
+/*
+ * Post an RX completion. With RX_CTRL_CQE_COMPRESS, frames of a burst
+ * that share flags and VLAN are collected and written as one block when
+ * the burst ends (rx_flush_bh), the block is full, or a frame differs.
+ */
+static void minimal_rx_complete(MinimalPCIeNICState *s,
+                                const struct cq_entry *cqe)
+{
+    if (!(s->rx_ctrl & RX_CTRL_CQE_COMPRESS)) {
+        /* Compression was just turned off: keep completions in order */
+        minimal_rx_flush(s);
+        minimal_cq_post(s, &s->rx_cq, minimal_rx_cq_size(s), cqe);
+        return;
+    }
+
+    if (s->rx_session_cnt &&
+        (s->rx_session_cnt == CQE_SESSION_MAX ||
+         !minimal_rx_session_fits(s, cqe))) {
+        minimal_rx_flush(s);
+    }
+
+    /* Fillers and split frames can't be compressed */
+    if (!cqe->len || cqe->hdr_len) {
+        minimal_cq_post(s, &s->rx_cq, minimal_rx_cq_size(s), cqe);
+        return;
+    }
+
+    s->rx_session[s->rx_session_cnt++] = *cqe;
+    qemu_bh_schedule(s->rx_flush_bh);
+}
+
+/*
+ * Striding RX: place the frame in the next free strides of the buffer at
+ * rx_head. The buffer is handed back (RX_BUF_LAST) once its strides are
+ * used up, or with a zero-length filler completion when the frame does
+ * not fit in what is left. Returns false if no buffer is available.
+ */
+static bool minimal_rx_strided(MinimalPCIeNICState *s,
+                               const struct iovec *iov, int iovcnt,
+                               size_t len, uint16_t flags, uint16_t vlan_tci)
+{
+    uint32_t need = DIV_ROUND_UP(len, s->rx_stride_size);
+    struct cq_entry cqe = { 0 };
+    struct rx_desc desc;
+
+    if (!need || need > s->rx_stride_num) {
+        s->rx_len_errors++;
+        return true;
+    }
+
+    if (s->rx_stride_cur + need > s->rx_stride_num) {
+        cqe.id = s->rx_head;
+        cqe.flags = RX_DONE | RX_BUF_LAST;
+        cqe.stride = s->rx_stride_cur;
+        minimal_rx_complete(s, &cqe);
+
+        s->rx_head = (s->rx_head + 1) % s->rx_ring_size;
+        s->rx_stride_cur = 0;
+        if (!minimal_rx_avail(s)) {
+            return false;
+        }
+    }
+
+    minimal_dma_read(s,
+                     s->rx_ring_base + s->rx_head * sizeof(desc),
+                     &desc, sizeof(desc));
+
+    if ((s->rx_stride_cur + need) * s->rx_stride_size > desc.len) {
+        s->rx_len_errors++;
+        return true;
+    }
+
+    minimal_rx_dma(s, desc.addr + s->rx_stride_cur * s->rx_stride_size,
+                   iov, iovcnt, 0, len);
+
+    cqe.id = s->rx_head;
+    cqe.len = len;
+    cqe.flags = flags;
+    cqe.vlan_tci = vlan_tci;
+    cqe.stride = s->rx_stride_cur;
+
+    s->rx_stride_cur += need;
+    if (s->rx_stride_cur == s->rx_stride_num) {
+        cqe.flags |= RX_BUF_LAST;
+        s->rx_head = (s->rx_head + 1) % s->rx_ring_size;
+        s->rx_stride_cur = 0;
+    }
+
+    minimal_rx_complete(s, &cqe);
+    return true;
+}
+
+/* Fire the RX MSI-X vector, unless the driver isn't waiting for it */
+static void minimal_rx_notify(MinimalPCIeNICState *s, uint32_t old_idx)
+{
+    uint32_t idx = minimal_rx_done_idx(s);
+
+    if (idx == old_idx) {
+        return;
+    }
+
+    if (!s->event_base ||
+        minimal_need_event(minimal_event_read(s, offsetof(struct event_idx,
+                                                          rx_used_event)),
+                           idx, old_idx, minimal_rx_done_size(s))) {
+        minimal_raise_irq(s, s->rx_vector);
+    }
+}
+
+/* End of an RX burst: write out collected completions */
+static void minimal_rx_flush_bh(void *opaque)
+{
+    MinimalPCIeNICState *s = opaque;
+    uint32_t old_idx = minimal_rx_done_idx(s);
 
-    NICState *nic;
-    NICConf conf;
-    NetClientState *nc;
+    minimal_rx_flush(s);
+    minimal_rx_notify(s, old_idx);
+}
 
-    uint64_t rx_ring_base;
-    uint32_t rx_ring_size;
-    uint32_t rx_head;
-    uint32_t rx_tail;
-} MinimalPCIeNICState;
+/*
+ * Place one frame in a function's RX ring, past the address filter.
+ * Returns 0 when no buffer is posted, so that the backend holds the frame
+ * until REG_RX_TAIL moves.
+ */
+static ssize_t minimal_rx_place(MinimalPCIeNICState *s,
+                                const uint8_t *buf,
+                                size_t size)
+{
+    struct rx_desc desc;
+    uint64_t desc_addr;
+    struct iovec iov[2];
+    int iovcnt;
+    size_t len, hdr_len = 0;
+    uint16_t flags = RX_DONE, vlan_tci = 0;
+    uint32_t old_idx;
+
+    /* No RX path configured: the frame goes nowhere */
+    if (!minimal_feat(s, DEV_CAP_RX)) {
+        return size;
+    }
 
-#define REG_RX_RING_BASE   0x10
-#define REG_RX_RING_SIZE   0x18
-#define REG_RX_TAIL        0x1C
-#define REG_RX_HEAD        0x20
+    if (!s->rx_ring_size || (s->queue_stopped & BIT(AQ_QTYPE_RX)))
+        return 0;   // driver not ready, or recovering the queue
 
-struct rx_desc {
-    uint64_t addr;
-    uint16_t len;
-    uint16_t flags;
-};
+    if (s->mtu && size > s->mtu + ETH_HLEN + VLAN_HLEN) {
+        s->rx_len_errors++;
+        return size;
+    }
 
-#define RX_DONE 1
+    /* No buffer posted: net layer queues the frame until REG_RX_TAIL is written */
+    if (!minimal_rx_avail(s)) {
+        return 0;
+    }
 
-/* Callback; packet received from host (eg. tap or user networking) */
-static ssize_t minimal_receive_packet(NetClientState *nc,
-                                      const uint8_t *buf,
-                                      size_t size);
+    minimal_cap(s, buf, size, false);
 
-/* Generate MSI/MSI-X interrupt */
-static void minimal_raise_irq(MinimalPCIeNICState *s, uint32_t vector)
-{
-    PCIDevice *pdev = &s->parent_obj;
+    old_idx = minimal_rx_done_idx(s);
+    len = minimal_rx_frame(s, buf, size, iov, &iovcnt, &flags, &vlan_tci);
 
-#ifdef MSIX_ENABLE
-    if (msix_enabled(pdev)) {
-        if (vector < msix_nr_vectors_allocated(pdev)) {
-            msix_notify(pdev, vector);
-        } else {
-            printf("invalid MSI-X vector %u\n", vector);
+    if (minimal_rx_striding(s)) {
+        bool placed = minimal_rx_strided(s, iov, iovcnt, len, flags, vlan_tci);
+
+        if (placed) {
+            s->rx_packets++;
+            s->rx_bytes += len;
         }
-        return;
+
+        /* A filler completion may have been posted even if nothing fit */
+        minimal_rx_notify(s, old_idx);
+        return placed ? size : 0;
     }
-#else
-    /* Fallback to MSI */
-    if (msi_enabled(pdev)) {
-        msi_notify(pdev, vector);
-        return;
+
+    desc_addr = s->rx_ring_base +
+                s->rx_head * sizeof(desc);
+
+    /* Read RX descriptor */
+    minimal_dma_read(s,
+                     desc_addr, &desc, sizeof(desc));
+
+    if (s->rx_ctrl & RX_CTRL_HDR_SPLIT) {
+        hdr_len = minimal_rx_hdr_len(buf, size);
+        if (hdr_len && (flags & RX_VLAN)) {
+            hdr_len -= VLAN_HLEN;
+        }
+    }
+
+    /* Headers that don't fit the header buffer go unsplit */
+    if (hdr_len > s->rx_hdr_size) {
+        hdr_len = 0;
+    }
+
+    if (len - hdr_len > desc.len) {
+        qemu_log_mask(LOG_GUEST_ERROR,
+                      "minimal_pcie_nic: RX frame len=%zu exceeds buffer "
+                      "len=%u\n", len, desc.len);
+        s->rx_len_errors++;
+        return size;
+    }
+
+    /* DMA packet into guest memory, headers first when splitting */
+    if (hdr_len) {
+        minimal_rx_dma(s, desc.hdr_addr, iov, iovcnt, 0, hdr_len);
+        flags |= RX_SPLIT;
     }
-#endif
+    minimal_rx_dma(s, desc.addr, iov, iovcnt, hdr_len, len - hdr_len);
+
+    desc.len = len;
+    desc.flags = flags;
+    desc.vlan_tci = vlan_tci;
+    desc.hdr_len = hdr_len;
+
+    if (s->rx_cq.base) {
+        /* Sequential completion, the descriptor itself is left untouched */
+        struct cq_entry cqe = {
+            .id = s->rx_head,
+            .len = desc.len,
+            .flags = desc.flags,
+            .vlan_tci = desc.vlan_tci,
+            .hdr_len = desc.hdr_len,
+        };
+
+        minimal_rx_complete(s, &cqe);
+    } else {
+        /* Update descriptor */
+        minimal_dma_write(s,
+                          desc_addr, &desc, sizeof(desc));
+    }
+
+    /* Advance ring */
+    s->rx_head = (s->rx_head + 1) % s->rx_ring_size;
+    s->rx_packets++;
+    s->rx_bytes += len;
+
+    minimal_rx_notify(s, old_idx);
 
-    printf("interrupts not enabled\n");
+    return size;
 }
 
-static void
-minimal_init_msix(MinimalPCIeNICState *s)
+/* Frames from the backend or another function go through the filter */
+static ssize_t minimal_rx_deliver(MinimalPCIeNICState *s,
+                                  const uint8_t *buf,
+                                  size_t size)
 {
-    int i, res;
+    /* Unwanted frame: consume it here, the guest never sees it */
+    if (s->rx_ring_size && !minimal_rx_filter(s, buf, size)) {
+        s->rx_filter_drops++;
+        return size;
+    }
 
-    res = msix_init(PCI_DEVICE(s), MSIX_NUM_VECTORS,
-                    &s->msix_bar,
-                    BAR1_MSIX_IDX,       /* BAR index */
-                    0,                  /* table offset */
-                    &s->msix_bar,
-                    BAR1_MSIX_IDX,       /* PBA BAR index */
-                    0x800,
-                    0x98, NULL);
+    return minimal_rx_place(s, buf, size);
+}
 
-    if (res < 0) {
-        return ;
+/*
+ * Traffic generator: UDP/IPv4 frames from 10.0.0.2 to 10.0.0.1, addressed
+ * to the function's own MAC. Flows differ in source port, sizes are
+ * spread evenly over [GEN_SIZE_MIN, GEN_SIZE_MAX].
+ */
+static size_t minimal_gen_frame(MinimalPCIeNICState *s)
+{
+    static const uint8_t src_mac[ETH_ALEN] = { 0x02, 0, 0, 0, 0, 0x01 };
+    uint32_t lo = MIN(MAX(s->gen_size_min, ETH_ZLEN), TX_MAX_FRAME);
+    uint32_t hi = MIN(MAX(s->gen_size_max, lo), TX_MAX_FRAME);
+    uint8_t *ip = s->gen_frame + ETH_HLEN;
+    uint8_t *udp = ip + sizeof(struct ip_header);
+    size_t len;
+
+    s->gen_rand = s->gen_rand * 1103515245 + 12345;
+    len = lo + (s->gen_rand >> 16) % (hi - lo + 1);
+
+    /* The driver keeps its current address in UC slot 0 */
+    if (s->uc_table[1] & UC_ENTRY_VALID) {
+        stl_le_p(s->gen_frame, s->uc_table[0]);
+        stw_le_p(s->gen_frame + 4, s->uc_table[1]);
     } else {
-        for (i = 0; i < MSIX_NUM_VECTORS; i++) {
-            msix_vector_use(PCI_DEVICE(s), i);
-        }
+        memcpy(s->gen_frame, s->conf.macaddr.a, ETH_ALEN);
     }
+    memcpy(s->gen_frame + ETH_ALEN, src_mac, ETH_ALEN);
+    stw_be_p(s->gen_frame + 2 * ETH_ALEN, ETH_P_IP);
+
+    memset(ip, 0, sizeof(struct ip_header));
+    ip[0] = 0x45;
+    stw_be_p(ip + 2, len - ETH_HLEN);
+    stw_be_p(ip + 4, s->gen_seq);
+    ip[8] = 64;
+    ip[9] = IP_PROTO_UDP;
+    stl_be_p(ip + 12, 0x0a000002);
+    stl_be_p(ip + 16, 0x0a000001);
+    stw_be_p(ip + 10, net_raw_checksum(ip, sizeof(struct ip_header)));
+
+    stw_be_p(udp, 1024 + s->gen_seq % MAX(s->gen_flows, 1));
+    stw_be_p(udp + 2, 9);   /* discard */
+    stw_be_p(udp + 4, len - ETH_HLEN - sizeof(struct ip_header));
+    stw_be_p(udp + 6, 0);   /* no checksum */
+
+    s->gen_seq++;
+    return len;
 }
 
-
-/* MMIO read callback */
-static uint64_t minimal_mmio_read(void *opaque, hwaddr addr, unsigned size)
+/* Paced in GEN_TICK_NS steps; frames without a posted buffer are dropped */
+static void minimal_gen_tick(void *opaque)
 {
     MinimalPCIeNICState *s = opaque;
-    uint64_t val = 0;
+    uint32_t budget = GEN_BURST_MAX;
+    uint32_t n;
 
-    /* Bounds check: guest may read beyond regs[] */
-    if (addr + size > sizeof(s->regs)) {
-        printf("minimal_pcie_nic: MMIO read out-of-bounds addr=0x%#" PRIx64 " size=%u\n",
-               (uint64_t)addr, size);
-        return 0;
+    if (!(s->lb_ctrl & LB_CTRL_GEN)) {
+        return;
     }
 
-    /* Read 1/2/4/8 bytes, little-endian */
-    switch (size) {
-    case 1:
-        val = *((uint8_t *)s->regs + addr);
-        break;
-    case 2:
-        val = le16_to_cpu(*(uint16_t *)((uint8_t *)s->regs + addr));
-        break;
-    case 4:
-        val = le32_to_cpu(*(uint32_t *)((uint8_t *)s->regs + addr));
-        break;
-    case 8:
-        val = le64_to_cpu(*(uint64_t *)((uint8_t *)s->regs + addr));
-        break;
-    default:
-        printf("minimal_pcie_nic: MMIO read unsupported size %u\n", size);
-        return 0;
+    if (s->gen_rate) {
+        s->gen_credit += (uint64_t)s->gen_rate * GEN_TICK_NS;
+        budget = MIN(s->gen_credit / NANOSECONDS_PER_SECOND, GEN_BURST_MAX);
+        s->gen_credit -= (uint64_t)budget * NANOSECONDS_PER_SECOND;
     }
 
-    printf("minimal_pcie_nic: MMIO read addr=0x%#" PRIx64 " size=%u val=0x%llx\n",
-           (uint64_t)addr, size, (unsigned long long)val);
+    for (n = 0; n < budget; n++) {
+        if (!minimal_rx_place(s, s->gen_frame, minimal_gen_frame(s))) {
+            break;
+        }
+    }
+    /* Unpaced: a full ring just ends the burst */
+    if (s->gen_rate) {
+        s->lb_drops += budget - n;
+    }
 
-    return val;
+    timer_mod(s->gen_timer,
+              qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + GEN_TICK_NS);
 }
 
-/* MMIO write callback */
-static void minimal_mmio_write(void *opaque,
-                               hwaddr addr,
-                               uint64_t data,
-                               unsigned size)
+/*
+ * Internal L2 switch between the PF and its enabled VFs, which all share
+ * the PF's backend. A unicast frame belongs to the function that has the
+ * address in its UC table; anything else is flooded to every function
+ * whose RX filter accepts it. Frames are never sent back to 'src'.
+ */
+static MinimalPCIeNICState *minimal_switch_port(MinimalPCIeNICState *pf,
+                                                uint16_t port)
 {
-    MinimalPCIeNICState *s = opaque;
+    PCIDevice *vf;
 
-    if (addr == REG_RX_RING_BASE) {
-        s->rx_ring_base = data;
-        return;
+    if (!port) {
+        return pf;
     }
+    vf = pcie_sriov_get_vf_at_index(&pf->parent_obj, port - 1);
+    return vf ? MINIMAL_PCIE_NIC(vf) : NULL;
+}
 
-    if (addr == REG_RX_RING_SIZE) {
-        s->rx_ring_size = data;
-        return;
-    }
+static MinimalPCIeNICState *minimal_switch_owner(MinimalPCIeNICState *pf,
+                                                 MinimalPCIeNICState *src,
+                                                 const uint8_t *buf,
+                                                 size_t size)
+{
+    uint16_t ports = 1 + pcie_sriov_num_vfs(&pf->parent_obj);
+    MinimalPCIeNICState *port;
+    uint16_t i;
 
-    if (addr == REG_RX_TAIL) {
-        s->rx_tail = data;
-        return;
+    if (size < ETH_HLEN || is_multicast_ether_addr(buf)) {
+        return NULL;
     }
 
-    if (addr + size > sizeof(s->regs)) {
-        printf("minimal_pcie_nic: MMIO write out-of-bounds addr=0x%#" PRIx64
-               " size=%u\n", (uint64_t)addr, size);
-        return;
+    for (i = 0; i < ports; i++) {
+        port = minimal_switch_port(pf, i);
+        if (port && port != src && minimal_rx_uc_match(port, buf)) {
+            return port;
+        }
     }
+    return NULL;
+}
 
-    printf("minimal_pcie_nic: MMIO write addr=0x%#" PRIx64
-           " size=%u data=0x%llx\n",
-           (uint64_t)addr, size, (unsigned long long)data);
-
+/* A full ring drops the copy for that function only */
+static void minimal_switch_flood(MinimalPCIeNICState *pf,
+                                 MinimalPCIeNICState *src,
+                                 const uint8_t *buf,
+                                 size_t size)
+{
+    uint16_t ports = 1 + pcie_sriov_num_vfs(&pf->parent_obj);
+    MinimalPCIeNICState *port;
+    uint16_t i;
+
+    for (i = 0; i < ports; i++) {
+        port = minimal_switch_port(pf, i);
+        if (port && port != src && minimal_rx_filter(port, buf, size)) {
+            minimal_rx_deliver(port, buf, size);
+        }
+    }
+}
 
-    /* This is only for msi/msi-x testing */
-    if (addr == 0x0 && size == 4) {
-        uint32_t vector = data & 0xff;
+/* Local unicast stays inside the device, the rest also goes to the backend */
+static void minimal_switch_tx(MinimalPCIeNICState *s,
+                              const uint8_t *buf,
+                              size_t size)
+{
+    MinimalPCIeNICState *pf = minimal_pf(s);
+    MinimalPCIeNICState *dst;
 
-        printf("minimal_pcie_nic: trigger IRQ vector=%u\n", vector);
-        minimal_raise_irq(s, vector);
+    /* Internal loopback: no filter, no switch, no backend */
+    if (s->lb_ctrl & LB_CTRL_LOOPBACK) {
+        if (!minimal_rx_place(s, buf, size)) {
+            s->lb_drops++;
+        }
         return;
     }
 
-    /* Normal register write */
-    switch (size) {
-    case 1:
-        *((uint8_t *)s->regs + addr) = data & 0xff;
-        break;
-    case 2:
-        *(uint16_t *)((uint8_t *)s->regs + addr) =
-            cpu_to_le16(data & 0xffff);
-        break;
-    case 4:
-        *(uint32_t *)((uint8_t *)s->regs + addr) =
-            cpu_to_le32(data & 0xffffffff);
-        break;
-    case 8:
-        *(uint64_t *)((uint8_t *)s->regs + addr) =
-            cpu_to_le64(data);
-        break;
-    default:
-        printf("minimal_pcie_nic: MMIO write unsupported size %u\n", size);
-        break;
+    if (pcie_sriov_num_vfs(&pf->parent_obj)) {
+        dst = minimal_switch_owner(pf, s, buf, size);
+        if (dst) {
+            minimal_rx_deliver(dst, buf, size);
+            return;
+        }
+        minimal_switch_flood(pf, s, buf, size);
     }
-}
 
-
-/* MemoryRegionOps for the MMIO region */
-static const MemoryRegionOps minimal_mmio_ops = {
-    .read = minimal_mmio_read,
-    .write = minimal_mmio_write,
-    .endianness = DEVICE_NATIVE_ENDIAN,
-};
+    qemu_send_packet(qemu_get_queue(pf->nic), buf, size);
+}
 
 static ssize_t minimal_receive_packet(NetClientState *nc,
                                       const uint8_t *buf,
                                       size_t size)
 {
     MinimalPCIeNICState *s = qemu_get_nic_opaque(nc);
-    struct rx_desc desc;
-    uint64_t desc_addr;
-
-    if (!s->rx_ring_size)
-        return 0;   // driver not ready
-
-    desc_addr = s->rx_ring_base +
-                s->rx_head * sizeof(desc);
-
-    /* Read RX descriptor */
-    pci_dma_read(&s->parent_obj,
-                 desc_addr, &desc, sizeof(desc));
-
-    /* DMA packet into guest memory */
-    pci_dma_write(&s->parent_obj,
-                  desc.addr, buf, size);
-
-    /* Update descriptor */
-    desc.len = size;
-    desc.flags = RX_DONE;
-
-    pci_dma_write(&s->parent_obj,
-                  desc_addr, &desc, sizeof(desc));
-
-    /* Advance ring */
-    s->rx_head = (s->rx_head + 1) % s->rx_ring_size;
+    MinimalPCIeNICState *dst;
 
-    /* Fire MSI-X vector 0 */
-    minimal_raise_irq(s, 0);
-    printf("minimal_pcie_nic: MSI-X interrupt triggered\n");
+    if (!pcie_sriov_num_vfs(&s->parent_obj)) {
+        return minimal_rx_deliver(s, buf, size);
+    }
 
+    /* One owner keeps back-pressure; a flooded frame can't be held back */
+    dst = minimal_switch_owner(s, NULL, buf, size);
+    if (dst) {
+        return minimal_rx_deliver(dst, buf, size);
+    }
+    minimal_switch_flood(s, NULL, buf, size);
     return size;
 }
 
@@ -273,17 +2694,164 @@ static NetClientInfo net_ops = {
     .receive = minimal_receive_packet,
 };
 
+/*
+ * Everything the driver programs back to its power-on value: registers,
+ * rings, filters, admin queue, counters and benchmark modes. Used at
+ * realize, system reset and FLR; config space and MSI-X are reset by the
+ * PCI core.
+ */
+static void minimal_reset_state(MinimalPCIeNICState *s)
+{
+    int i;
+
+    minimal_regs_reset(s);
+
+    qemu_bh_cancel(s->tx_bh);
+    qemu_bh_cancel(s->rx_flush_bh);
+    timer_del(s->stats_timer);
+    timer_del(s->gen_timer);
+
+    s->rx_ring_base = 0;
+    s->rx_ring_size = 0;
+    s->rx_hdr_size = 0;
+    s->rx_stride_size = 0;
+    s->rx_stride_num = 0;
+    minimal_cq_reset(&s->rx_cq, 0);
+    minimal_rx_rewind(s);
+
+    s->tx_ring_base = 0;
+    s->tx_ring_size = 0;
+    s->tx_ctrl = 0;
+    minimal_cq_reset(&s->tx_cq, 0);
+    minimal_tx_rewind(s);
+
+    s->drv_features = s->dev_caps;
+    s->event_base = 0;
+    /* Until the driver creates its queues */
+    s->rx_vector = 0;
+    s->tx_vector = s->vectors > 1 ? 1 : 0;
+    s->irq_pending = 0;
+
+    /* Accept everything until the driver programs the RX filter */
+    s->rx_ctrl = RX_CTRL_PROMISC;
+    memset(s->uc_table, 0, sizeof(s->uc_table));
+    memset(s->mc_hash, 0, sizeof(s->mc_hash));
+    memset(s->vlan_table, 0, sizeof(s->vlan_table));
+    s->rx_filter_drops = 0;
+    s->rx_len_errors = 0;
+    s->mtu = 0;
+
+    s->rx_packets = 0;
+    s->rx_bytes = 0;
+    s->tx_packets = 0;
+    s->tx_bytes = 0;
+    s->tx_errors = 0;
+    s->stats_base = 0;
+    s->stats_interval = 0;
+
+    s->aq_base = 0;
+    s->aq_size = 0;
+    s->aq_head = 0;
+
+    /* Generator defaults, matching the register reset values */
+    s->lb_ctrl = 0;
+    s->lb_drops = 0;
+    s->gen_rate = 0;
+    s->gen_size_min = ETH_ZLEN;
+    s->gen_size_max = ETH_ZLEN;
+    s->gen_flows = 1;
+    s->gen_credit = 0;
+}
+
 /* Realize function: called when device is instantiated */
 static void minimal_pcie_nic_realize(PCIDevice *pdev, Error **errp)
 {
+    ERRP_GUARD();
     MinimalPCIeNICState *s = MINIMAL_PCIE_NIC(pdev);
     uint8_t *macaddr;
 
     printf("minimal_pcie_nic: realize called (host log)\n");
 
+    /* Stage 01: registers only, so nothing below BAR0 is created */
+    if (s->mmio_only) {
+        if (s->sriov_vfs) {
+            error_setg(errp, "mmio-only can't be combined with sriov-vfs");
+            return;
+        }
+        s->msix = false;
+        s->llq = false;
+        s->rx = false;
+        s->tx = false;
+        s->offloads = false;
+        s->vectors = 1;
+    }
+
+    if (s->vectors < 1 ||
+        s->vectors > (s->msix ? MSIX_MAX_VECTORS : MSI_MAX_VECTORS)) {
+        error_setg(errp, "vectors must be between 1 and %d for %s",
+                   s->msix ? MSIX_MAX_VECTORS : MSI_MAX_VECTORS,
+                   s->msix ? "MSI-X" : "MSI");
+        return;
+    }
+
+    if (s->sriov_vfs > SRIOV_MAX_VFS) {
+        error_setg(errp, "sriov-vfs must be at most %d", SRIOV_MAX_VFS);
+        return;
+    }
+
+    /*
+     * VFs are MSI-X only and have no BAR4. A VF is a port of the PF's
+     * switch and takes the PF's MAC plus VF number + 1, carried across
+     * the three NIC-specific bytes so no two functions share an address.
+     */
+    if (pci_is_vf(pdev)) {
+        MACAddr *mac = &s->conf.macaddr;
+        uint32_t nic_id;
+
+        s->msix = true;
+        s->llq = false;
+        s->sriov_vfs = 0;
+
+        *mac = minimal_pf(s)->conf.macaddr;
+        nic_id = (mac->a[3] << 16 | mac->a[4] << 8 | mac->a[5]) +
+                 pcie_sriov_vf_number(pdev) + 1;
+        if (nic_id > 0xffffff) {
+            error_setg(errp, "VF %d MAC would wrap past the PF's NIC bytes",
+                       pcie_sriov_vf_number(pdev));
+            return;
+        }
+        mac->a[3] = nic_id >> 16;
+        mac->a[4] = nic_id >> 8;
+        mac->a[5] = nic_id;
+    }
+
+    /* What the properties allow; REG_DRV_FEATURES narrows it at probe */
+    s->dev_caps = 0;
+    if (!s->mmio_only) {
+        s->dev_caps |= (s->msix ? DEV_CAP_MSIX : DEV_CAP_MSI) |
+                       DEV_CAP_EVENT_IDX;
+    }
+    if (!s->tx) {
+        s->llq = false;     /* BAR4 only carries TX descriptors */
+    }
+    if (s->llq) {
+        s->dev_caps |= DEV_CAP_LLQ;
+    }
+    if (s->rx) {
+        s->dev_caps |= DEV_CAP_RX;
+    }
+    if (s->tx) {
+        s->dev_caps |= DEV_CAP_TX;
+    }
+    if (s->offloads) {
+        s->dev_caps |= DEV_CAP_VLAN | DEV_CAP_HDR_SPLIT |
+                       DEV_CAP_RX_STRIDE | DEV_CAP_CQE_COMPRESS;
+    }
+
     /* PCI config space: set vendor/device IDs and class */
     pci_config_set_vendor_id(pdev->config, 0x1af4);
-    pci_config_set_device_id(pdev->config, 0x10f1);
+    pci_config_set_device_id(pdev->config, pci_is_vf(pdev) ?
+                             MINIMAL_VF_DEVICE_ID : MINIMAL_DEVICE_ID);
 
     /* Class: Ethernet controller */
     pci_config_set_class(pdev->config, PCI_CLASS_NETWORK_ETHERNET);
@@ -291,8 +2859,8 @@ static void minimal_pcie_nic_realize(PCIDevice *pdev, Error **errp)
     /* Revision ID */
     pci_config_set_revision(pdev->config, 0x01);
 
-    /* Initialize internal "registers" to zero */
-    memset(s->regs, 0, sizeof(s->regs));
+    /* Register file, with reset values */
+    minimal_regs_init(s);
 
     /* Command register: enable memory accesses and bus mastering */
     uint16_t cmd = PCI_COMMAND_MEMORY | PCI_COMMAND_MASTER;
@@ -301,35 +2869,102 @@ static void minimal_pcie_nic_realize(PCIDevice *pdev, Error **errp)
     /* Create BAR0 MMIO region
      * - Size = 4 KB
      * - This does NOT allocate 4 KB memory
-     * - Only traps guest accesses to read/write callbacks
+     * - Only traps guest accesses to the register block's callbacks
      */
-    memory_region_init_io(&s->mmio, OBJECT(s), &minimal_mmio_ops, s,
-                          "minimal-pcie-mmio", 0x1000);
+    memory_region_init(&s->mmio, OBJECT(s), "minimal-pcie-mmio", MMIO_BAR_SIZE);
+    memory_region_add_subregion(&s->mmio, 0, &s->reg_array->mem);
 
     /* Register BAR0 with PCI core
-     * Guest OS will map this BAR, reads/writes hit callbacks
+     * Guest OS will map this BAR, reads/writes hit callbacks.
+     * A VF's BARs are placed by the PF's SR-IOV capability instead.
+     */
+    if (pci_is_vf(pdev)) {
+        pcie_sriov_vf_register_bar(pdev, BAR0_IDX, &s->mmio);
+    } else {
+        pci_register_bar(pdev, BAR0_IDX , PCI_BASE_ADDRESS_SPACE_MEMORY |
+                         PCI_BASE_ADDRESS_MEM_TYPE_64, &s->mmio);
+    }
+
+    /* BAR2: MSI-X table, absent when running with MSI */
+    if (s->msix) {
+        memory_region_init(&s->msix_bar, OBJECT(s), "minimal-msix-bar",
+                           MSIX_BAR_SIZE);
+
+        if (pci_is_vf(pdev)) {
+            pcie_sriov_vf_register_bar(pdev, BAR2_MSIX_IDX, &s->msix_bar);
+        } else {
+            pci_register_bar(pdev, BAR2_MSIX_IDX,
+                             PCI_BASE_ADDRESS_SPACE_MEMORY |
+                             PCI_BASE_ADDRESS_MEM_TYPE_64, &s->msix_bar);
+        }
+    }
+
+    /*
+     * BAR4: prefetchable RAM the driver maps write-combining for LLQ.
+     * BAR0 and BAR2 stay non-prefetchable: merged or replayed writes
+     * would corrupt doorbells and the MSI-X table.
      */
-    pci_register_bar(pdev, BAR0_IDX , PCI_BASE_ADDRESS_SPACE_MEMORY, &s->mmio);
-
-    /* BAR1: MSI-X table */
-    memory_region_init(&s->msix_bar, OBJECT(s), "minimal-msix-bar", MSIX_BAR_SIZE);
-
-    pci_register_bar(pdev, BAR1_MSIX_IDX, PCI_BASE_ADDRESS_SPACE_MEMORY, &s->msix_bar);
-
-#ifdef MSIX_ENABLE
-    /* MSI-X capability */
-    minimal_init_msix(s);
-#else
-    /* Enable MSI (number of vectors) with per-vector masking */
-    if (msi_init(pdev,
-                 0,      /* offset in config space */
-                 4,      /* number of MSI vectors */
-                 false,  /* 32-bit address */
-                 true,   /* per-vector masking enabled */
-                 errp) < 0) {
+    if (s->llq) {
+        memory_region_init_ram(&s->llq_bar, OBJECT(s), "minimal-llq-bar",
+                               LLQ_BAR_SIZE, errp);
+        if (*errp) {
+            goto err_regs;
+        }
+        pci_register_bar(pdev, BAR4_LLQ_IDX,
+                         PCI_BASE_ADDRESS_SPACE_MEMORY |
+                         PCI_BASE_ADDRESS_MEM_TYPE_64 |
+                         PCI_BASE_ADDRESS_MEM_PREFETCH, &s->llq_bar);
+    }
+
+    if (s->mmio_only) {
+        /* No interrupt capability: the driver polls BAR0 */
+    } else if (s->msix) {
+        /* MSI-X capability */
+        if (minimal_init_msix(s, errp) < 0) {
+            goto err_regs;
+        }
+    } else {
+        /* Enable MSI (number of vectors) with per-vector masking */
+        if (msi_init(pdev,
+                     0,          /* offset in config space */
+                     s->vectors, /* number of MSI vectors */
+                     false,      /* 32-bit address */
+                     true,       /* per-vector masking enabled */
+                     errp) < 0) {
+            goto err_regs;
+        }
+    }
+
+    /* PCIe capability, and ARI so VFs can use function numbers past 7 */
+    if (pcie_endpoint_cap_init(pdev, 0) < 0) {
+        error_setg(errp, "failed to add the PCIe capability");
+        goto err_irq;
+    }
+    /* Initiate FLR in Device Control lands in minimal_pcie_nic_reset() */
+    pcie_cap_flr_init(pdev);
+    pcie_ari_init(pdev, ARI_CAP_OFFSET);
+
+    /* ATS: the guest's IOMMU driver turns it on when it can invalidate */
+    if (s->ats) {
+        pcie_ats_init(pdev, ATS_CAP_OFFSET, true);
+    }
+
+    if (minimal_cap_init(s, errp) < 0) {
+        goto err_pcie;
+    }
+
+    s->tx_bh = qemu_bh_new_guarded(minimal_tx_bh, s,
+                                   &DEVICE(pdev)->mem_reentrancy_guard);
+    s->rx_flush_bh = qemu_bh_new_guarded(minimal_rx_flush_bh, s,
+                                         &DEVICE(pdev)->mem_reentrancy_guard);
+    s->stats_timer = timer_new_ms(QEMU_CLOCK_VIRTUAL, minimal_stats_timer, s);
+    s->gen_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, minimal_gen_tick, s);
+    minimal_reset_state(s);
+
+    /* A VF has no backend of its own; its MAC was derived above */
+    if (pci_is_vf(pdev)) {
         return;
     }
-#endif
 
     qemu_macaddr_default_if_unset(&s->conf.macaddr);
     macaddr = s->conf.macaddr.a;
@@ -344,27 +2979,287 @@ static void minimal_pcie_nic_realize(PCIDevice *pdev, Error **errp)
 
     qemu_format_nic_info_str(qemu_get_queue(s->nic), macaddr);
 
+    /*
+     * SR-IOV last: the VFs are realized right here and take their MAC
+     * from the PF. Each VF gets its own BAR0 and MSI-X BAR.
+     */
+    if (s->sriov_vfs) {
+        if (!pcie_sriov_pf_init(pdev, SRIOV_CAP_OFFSET,
+                                TYPE_MINIMAL_PCIE_NIC_VF,
+                                MINIMAL_VF_DEVICE_ID, s->sriov_vfs,
+                                s->sriov_vfs, SRIOV_VF_OFFSET,
+                                SRIOV_VF_STRIDE, errp)) {
+            goto err_nic;
+        }
+        pcie_sriov_pf_init_vf_bar(pdev, BAR0_IDX,
+                                  PCI_BASE_ADDRESS_SPACE_MEMORY |
+                                  PCI_BASE_ADDRESS_MEM_TYPE_64,
+                                  MMIO_BAR_SIZE);
+        pcie_sriov_pf_init_vf_bar(pdev, BAR2_MSIX_IDX,
+                                  PCI_BASE_ADDRESS_SPACE_MEMORY |
+                                  PCI_BASE_ADDRESS_MEM_TYPE_64,
+                                  MSIX_BAR_SIZE);
+    }
+    return;
+
+    /* Unwind in the reverse order of the above, as uninit does */
+err_nic:
+    qemu_del_nic(s->nic);
+    s->nic = NULL;
+    qemu_bh_delete(s->tx_bh);
+    qemu_bh_delete(s->rx_flush_bh);
+    timer_free(s->stats_timer);
+    timer_free(s->gen_timer);
+    minimal_cap_exit(s);
+err_pcie:
+    pcie_cap_exit(pdev);
+err_irq:
+    if (s->msix) {
+        msix_uninit(pdev, &s->msix_bar, &s->msix_bar);
+    } else if (!s->mmio_only) {
+        msi_uninit(pdev);
+    }
+err_regs:
+    minimal_regs_free(s);
+}
+
+/* VF Enable and NumVFs live in the PF's SR-IOV capability; FLR in the PCIe one */
+static void minimal_pcie_nic_write_config(PCIDevice *pdev, uint32_t addr,
+                                          uint32_t val, int len)
+{
+    pci_default_write_config(pdev, addr, val, len);
+    pcie_cap_flr_write_config(pdev, addr, val, len);
+    pcie_sriov_config_write(pdev, addr, val, len);
+    minimal_iotlb_update(MINIMAL_PCIE_NIC(pdev));
+}
+
+/*
+ * System reset and FLR. The device forgets everything the driver set up,
+ * drops cached translations, and a PF also disables its VFs. Frames held
+ * by the backend stay queued until the driver posts a new RX ring.
+ */
+static void minimal_pcie_nic_reset(DeviceState *dev)
+{
+    PCIDevice *pdev = PCI_DEVICE(dev);
+    MinimalPCIeNICState *s = MINIMAL_PCIE_NIC(pdev);
+
+    if (s->iotlb_on) {
+        pci_iommu_unregister_iotlb_notifier(pdev, PCI_NO_PASID,
+                                            &s->iotlb_notifier);
+        s->iotlb_on = false;
+    }
+    minimal_iotlb_flush(s);
+    minimal_reset_state(s);
+
+    if (!pci_is_vf(pdev)) {
+        pcie_sriov_pf_reset(pdev);
+    }
 }
 
 static void minimal_pcie_nic_uninit(PCIDevice *pdev)
 {
     MinimalPCIeNICState *s = MINIMAL_PCIE_NIC(pdev);
 
+    /* VFs go first: they still point at the PF */
+    if (s->sriov_vfs) {
+        pcie_sriov_pf_exit(pdev);
+    }
+
+    if (s->iotlb_on) {
+        pci_iommu_unregister_iotlb_notifier(pdev, PCI_NO_PASID,
+                                            &s->iotlb_notifier);
+    }
+
+    qemu_bh_delete(s->tx_bh);
+    qemu_bh_delete(s->rx_flush_bh);
+    timer_free(s->stats_timer);
+    timer_free(s->gen_timer);
+    minimal_cap_exit(s);
+    minimal_regs_free(s);
+
     /* Clean up NIC */
-    qemu_del_nic(s->nic);
+    if (s->nic) {
+        qemu_del_nic(s->nic);
+    }
 
     /* Clean up MSI/MSI-X */
-#ifdef MSIX_ENABLE
-    msix_uninit(pdev);
-#else
-    msi_uninit(pdev);
-#endif
+    if (s->msix) {
+        msix_uninit(pdev, &s->msix_bar, &s->msix_bar);
+    } else if (!s->mmio_only) {
+        msi_uninit(pdev);
+    }
+    pcie_cap_exit(pdev);
     printf("pcie nic un-init\n");
 }
 
+/*
+ * Migration. Every write the device makes to guest memory goes through
+ * minimal_dma_rw() and is dirty-logged by the memory core, pre-translated
+ * or not, and BAR4 is a RAM region migrated with the rest of RAM, so
+ * only device-side state is described here. Nothing is written to the
+ * guest from pre_save: the final RAM pass has already been taken by
+ * then. A pending compressed RX session and posted-but-unsent TX
+ * descriptors are carried over and completed on the destination instead.
+ */
+static const VMStateDescription vmstate_minimal_cq = {
+    .name = "minimal-pcie-nic/cq",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (const VMStateField[]) {
+        VMSTATE_UINT64(base, MinimalCQ),
+        VMSTATE_UINT32(tail, MinimalCQ),
+        VMSTATE_UINT16(phase, MinimalCQ),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_minimal_cq_entry = {
+    .name = "minimal-pcie-nic/cq-entry",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (const VMStateField[]) {
+        VMSTATE_UINT16(id, struct cq_entry),
+        VMSTATE_UINT16(len, struct cq_entry),
+        VMSTATE_UINT16(flags, struct cq_entry),
+        VMSTATE_UINT16(vlan_tci, struct cq_entry),
+        VMSTATE_UINT16(hdr_len, struct cq_entry),
+        VMSTATE_UINT16(stride, struct cq_entry),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static bool minimal_msix_present(void *opaque, int version_id)
+{
+    MinimalPCIeNICState *s = opaque;
+
+    return s->msix;
+}
+
+/* Reject a stream that would index outside the rings or the session */
+static int minimal_post_load(void *opaque, int version_id)
+{
+    MinimalPCIeNICState *s = opaque;
+
+    if (s->rx_ring_size > UINT16_MAX || s->tx_ring_size > UINT16_MAX ||
+        (s->rx_ring_size && (s->rx_head >= s->rx_ring_size ||
+                             s->rx_tail >= s->rx_ring_size)) ||
+        (s->tx_ring_size && (s->tx_head >= s->tx_ring_size ||
+                             s->tx_tail >= s->tx_ring_size)) ||
+        s->rx_session_cnt > CQE_SESSION_MAX ||
+        s->rx_stride_cur > s->rx_stride_num ||
+        s->rx_vector >= s->vectors || s->tx_vector >= s->vectors ||
+        (s->aq_size && s->aq_head >= s->aq_size)) {
+        return -EINVAL;
+    }
+
+    if (s->rx_session_cnt) {
+        qemu_bh_schedule(s->rx_flush_bh);
+    }
+    /* The IOTLB isn't migrated, it refills from the vIOMMU on demand */
+    minimal_iotlb_update(s);
+
+    if (s->tx_ring_size && s->tx_head != s->tx_tail) {
+        qemu_bh_schedule(s->tx_bh);
+    }
+    return 0;
+}
+
+static const VMStateDescription vmstate_minimal_pcie_nic = {
+    .name = TYPE_MINIMAL_PCIE_NIC,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .post_load = minimal_post_load,
+    .fields = (const VMStateField[]) {
+        VMSTATE_PCI_DEVICE(parent_obj, MinimalPCIeNICState),
+        VMSTATE_MSIX_TEST(parent_obj, MinimalPCIeNICState,
+                          minimal_msix_present),
+        VMSTATE_UINT32_ARRAY(regs, MinimalPCIeNICState, MMIO_BAR_SIZE / 4),
+
+        VMSTATE_UINT64(rx_ring_base, MinimalPCIeNICState),
+        VMSTATE_UINT32(rx_ring_size, MinimalPCIeNICState),
+        VMSTATE_UINT32(rx_head, MinimalPCIeNICState),
+        VMSTATE_UINT32(rx_tail, MinimalPCIeNICState),
+        VMSTATE_UINT32(rx_hdr_size, MinimalPCIeNICState),
+        VMSTATE_STRUCT(rx_cq, MinimalPCIeNICState, 1, vmstate_minimal_cq,
+                       MinimalCQ),
+        VMSTATE_STRUCT_ARRAY(rx_session, MinimalPCIeNICState,
+                             CQE_SESSION_MAX, 1, vmstate_minimal_cq_entry,
+                             struct cq_entry),
+        VMSTATE_UINT32(rx_session_cnt, MinimalPCIeNICState),
+        VMSTATE_UINT32(rx_stride_size, MinimalPCIeNICState),
+        VMSTATE_UINT32(rx_stride_num, MinimalPCIeNICState),
+        VMSTATE_UINT32(rx_stride_cur, MinimalPCIeNICState),
+
+        VMSTATE_UINT64(tx_ring_base, MinimalPCIeNICState),
+        VMSTATE_UINT32(tx_ring_size, MinimalPCIeNICState),
+        VMSTATE_UINT32(tx_head, MinimalPCIeNICState),
+        VMSTATE_UINT32(tx_tail, MinimalPCIeNICState),
+        VMSTATE_STRUCT(tx_cq, MinimalPCIeNICState, 1, vmstate_minimal_cq,
+                       MinimalCQ),
+        VMSTATE_UINT32(tx_ctrl, MinimalPCIeNICState),
+
+        VMSTATE_UINT64(event_base, MinimalPCIeNICState),
+        VMSTATE_UINT32(rx_vector, MinimalPCIeNICState),
+        VMSTATE_UINT32(tx_vector, MinimalPCIeNICState),
+        VMSTATE_UINT32(irq_pending, MinimalPCIeNICState),
+
+        VMSTATE_UINT32(rx_ctrl, MinimalPCIeNICState),
+        VMSTATE_UINT32_ARRAY(uc_table, MinimalPCIeNICState,
+                             UC_TABLE_ENTRIES * 2),
+        VMSTATE_UINT32_ARRAY(mc_hash, MinimalPCIeNICState, MC_HASH_WORDS),
+        VMSTATE_UINT32_ARRAY(vlan_table, MinimalPCIeNICState,
+                             VLAN_TABLE_WORDS),
+        VMSTATE_UINT32(rx_filter_drops, MinimalPCIeNICState),
+        VMSTATE_UINT32(rx_len_errors, MinimalPCIeNICState),
+        VMSTATE_UINT32(mtu, MinimalPCIeNICState),
+
+        VMSTATE_UINT64(rx_packets, MinimalPCIeNICState),
+        VMSTATE_UINT64(rx_bytes, MinimalPCIeNICState),
+        VMSTATE_UINT64(tx_packets, MinimalPCIeNICState),
+        VMSTATE_UINT64(tx_bytes, MinimalPCIeNICState),
+        VMSTATE_UINT64(tx_errors, MinimalPCIeNICState),
+        VMSTATE_UINT64(stats_base, MinimalPCIeNICState),
+        VMSTATE_UINT32(stats_interval, MinimalPCIeNICState),
+        VMSTATE_UINT32(stats_seq, MinimalPCIeNICState),
+        VMSTATE_TIMER_PTR(stats_timer, MinimalPCIeNICState),
+
+        VMSTATE_UINT64(aq_base, MinimalPCIeNICState),
+        VMSTATE_UINT32(aq_size, MinimalPCIeNICState),
+        VMSTATE_UINT32(aq_head, MinimalPCIeNICState),
+
+        VMSTATE_UINT32(lb_ctrl, MinimalPCIeNICState),
+        VMSTATE_UINT32(lb_drops, MinimalPCIeNICState),
+        VMSTATE_UINT32(gen_rate, MinimalPCIeNICState),
+        VMSTATE_UINT32(gen_size_min, MinimalPCIeNICState),
+        VMSTATE_UINT32(gen_size_max, MinimalPCIeNICState),
+        VMSTATE_UINT32(gen_flows, MinimalPCIeNICState),
+        VMSTATE_UINT32(drv_features, MinimalPCIeNICState),
+        VMSTATE_UINT32(queue_stopped, MinimalPCIeNICState),
+        VMSTATE_UINT32(gen_seq, MinimalPCIeNICState),
+        VMSTATE_UINT32(gen_rand, MinimalPCIeNICState),
+        VMSTATE_UINT64(gen_credit, MinimalPCIeNICState),
+        VMSTATE_TIMER_PTR(gen_timer, MinimalPCIeNICState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 /* Device properties */
 static Property minimal_pcie_nic_properties[] = {
     DEFINE_NIC_PROPERTIES(MinimalPCIeNICState, conf),
+    DEFINE_PROP_BOOL("llq", MinimalPCIeNICState, llq, true),
+    DEFINE_PROP_BOOL("mmio-only", MinimalPCIeNICState, mmio_only, false),
+    DEFINE_PROP_BOOL("rx", MinimalPCIeNICState, rx, true),
+    DEFINE_PROP_BOOL("tx", MinimalPCIeNICState, tx, true),
+    DEFINE_PROP_BOOL("offloads", MinimalPCIeNICState, offloads, true),
+    DEFINE_PROP_BOOL("msix", MinimalPCIeNICState, msix, true),
+    DEFINE_PROP_UINT32("vectors", MinimalPCIeNICState, vectors, 4),
+    DEFINE_PROP_UINT16("sriov-vfs", MinimalPCIeNICState, sriov_vfs, 0),
+    DEFINE_PROP_BOOL("ats", MinimalPCIeNICState, ats, true),
+    DEFINE_PROP_STRING("capture", MinimalPCIeNICState, cap_path),
+    DEFINE_PROP_SIZE("capture-size", MinimalPCIeNICState, cap_size, 4 * MiB),
+    DEFINE_PROP_UINT32("capture-snaplen", MinimalPCIeNICState, cap_snaplen,
+                       128),
+    DEFINE_PROP_UINT32("capture-sample", MinimalPCIeNICState, cap_sample, 1),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -376,19 +3271,33 @@ static void minimal_pcie_nic_class_init(ObjectClass *klass, void *data)
 
     k->realize  = minimal_pcie_nic_realize;
     k->exit = minimal_pcie_nic_uninit;
+    k->config_write = minimal_pcie_nic_write_config;
     k->vendor_id = 0x1af4;
-    k->device_id = 0x10f1;
+    k->device_id = MINIMAL_DEVICE_ID;
 
     /* Class: Ethernet controller */
     k->class_id  = PCI_CLASS_NETWORK_ETHERNET;
     k->revision = 0x1; //set initial revision
     set_bit(DEVICE_CATEGORY_NETWORK, dc->categories);
     dc->desc = "Minimal PCIe NIC Card";
+    dc->vmsd = &vmstate_minimal_pcie_nic;
+    device_class_set_legacy_reset(dc, minimal_pcie_nic_reset);
     
     /* Register device properties (netdev, mac, etc.) */
     device_class_set_props(dc, minimal_pcie_nic_properties);
 }
 
+/* VF: same register model, created and owned by the PF */
+static void minimal_pcie_nic_vf_class_init(ObjectClass *klass, void *data)
+{
+    PCIDeviceClass *k = PCI_DEVICE_CLASS(klass);
+    DeviceClass *dc = DEVICE_CLASS(klass);
+
+    k->device_id = MINIMAL_VF_DEVICE_ID;
+    dc->desc = "Minimal PCIe NIC Virtual Function";
+    dc->user_creatable = false;
+}
+
 /* Type registration */
 static void minimal_pcie_nic_register_types(void)
 {
@@ -405,7 +3314,14 @@ static void minimal_pcie_nic_register_types(void)
         .interfaces    = interfaces,
     };
 
+    static const TypeInfo minimal_pcie_nic_vf_info = {
+        .name          = TYPE_MINIMAL_PCIE_NIC_VF,
+        .parent        = TYPE_MINIMAL_PCIE_NIC,
+        .class_init    = minimal_pcie_nic_vf_class_init,
+    };
+
     type_register_static(&minimal_pcie_nic_info);
+    type_register_static(&minimal_pcie_nic_vf_info);
 }
 
 /* Initialize the type at QEMU startup */
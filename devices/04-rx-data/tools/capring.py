@@ -0,0 +1,80 @@
+#!/usr/bin/env python3
+#
+# capring.py - stream a minimal-pcie-nic capture ring as pcapng
+#
+# The device mirrors frames into a host file (-device ...,capture=<path>).
+# This follows the ring and writes a pcapng stream to stdout, so the
+# capture can be watched live without touching the guest:
+#
+#   capring.py /dev/shm/nic.cap | tcpdump -n -r -
+#   capring.py /dev/shm/nic.cap > trace.pcapng
+#
+# Layout: see struct cap_ring_hdr in qemu/msix-pcie-nic.c.
+
+import mmap
+import struct
+import sys
+import time
+
+CAP_MAGIC = 0x313050414343494e     # "NICCAP01"
+HDR = struct.Struct("=QIIQQQ")     # magic .. data_size
+HEAD_OFFSET = HDR.size             # u64 head follows
+
+
+def main():
+    if len(sys.argv) != 2:
+        sys.exit("usage: capring.py <capture file>")
+
+    with open(sys.argv[1], "rb") as f:
+        m = mmap.mmap(f.fileno(), 0, prot=mmap.PROT_READ)
+
+    magic, version, pcapng_len, pcapng_off, data_off, size = \
+        HDR.unpack_from(m, 0)
+    if magic != CAP_MAGIC or version != 1:
+        sys.exit("%s: not a capture ring" % sys.argv[1])
+
+    def head():
+        return struct.unpack_from("=Q", m, HEAD_OFFSET)[0]
+
+    out = sys.stdout.buffer
+    out.write(m[pcapng_off:pcapng_off + pcapng_len])
+
+    # Start at the current head: older blocks may already be half overwritten
+    pos = head()
+    lost = 0
+    try:
+        while True:
+            h = head()
+            if h - pos > size:
+                lost += 1
+                pos = h
+            if pos == h:
+                out.flush()
+                time.sleep(0.01)
+                continue
+
+            off = pos % size
+            btype, blen = struct.unpack_from("=II", m, data_off + off)
+            if btype == 0:
+                pos += size - off
+                continue
+
+            block = m[data_off + off:data_off + off + blen]
+            # The producer lapped us while we copied: drop it and catch up
+            if head() - pos > size or blen < 12 or blen > size - off:
+                lost += 1
+                pos = head()
+                continue
+
+            out.write(block)
+            pos += blen
+    except (KeyboardInterrupt, BrokenPipeError):
+        pass
+    finally:
+        if lost:
+            print("capring: fell behind the device %d times" % lost,
+                  file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main()